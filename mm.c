@@ -1,7 +1,47 @@
 #include "mm.h"
-#include "memlib.h"
+#include "mm_ext.h"
+#include <immintrin.h>
+#include <stdint.h>
 #include <string.h>
 
+// 堆的后端.
+// MM_BACKEND_MEMLIB: 实验提供的 memlib 堆模拟器, 基指针恒为 0x800000000.
+// MM_BACKEND_VMEM: 一次性保留 4 GiB 的虚拟地址空间 (PROT_NONE),
+//                  按需用 mprotect 提交, 用 madvise 归还.
+#define MM_BACKEND_MEMLIB 0
+#define MM_BACKEND_VMEM 1
+
+#ifndef MM_BACKEND
+#define MM_BACKEND MM_BACKEND_MEMLIB
+#endif
+
+// 大页.
+// MM_HUGE_PAGES_NONE: 不特别处理.
+// MM_HUGE_PAGES_THP: 保留区对齐到 2 MiB, 按 2 MiB 提交, 并用
+//                    madvise(MADV_HUGEPAGE) 请求透明大页.
+// MM_HUGE_PAGES_HUGETLB: 同上, 但先尝试用 MAP_HUGETLB 提交, 失败时退回透明大页.
+// 都需要 vmem 后端.
+#define MM_HUGE_PAGES_NONE 0
+#define MM_HUGE_PAGES_THP 1
+#define MM_HUGE_PAGES_HUGETLB 2
+
+#ifndef MM_HUGE_PAGES
+#define MM_HUGE_PAGES MM_HUGE_PAGES_NONE
+#endif
+
+#if MM_HUGE_PAGES != MM_HUGE_PAGES_NONE && MM_BACKEND != MM_BACKEND_VMEM
+#error "MM_HUGE_PAGES requires MM_BACKEND_VMEM"
+#endif
+
+#if MM_BACKEND == MM_BACKEND_MEMLIB
+#include "memlib.h"
+#endif
+#include <sys/mman.h>
+#if MM_BACKEND == MM_BACKEND_VMEM
+#include <pthread.h>
+#include <time.h>
+#endif
+
 /**
  * 基于显式分离链表的 malloc lab.
  */
@@ -40,15 +80,17 @@
 /**
  * flag 0: 标志这个块是否空闲
  * flag 1: 标志上一个块是否空闲
- * flag 3: 备用
+ * flag 2: 标志这是托儿所中的对象, 不是普通的块
  */
 
 /**
  * `prev offset` 是 32 位无符号整数，且对齐到 8
- * 的倍数。这表示前驱节点的指针相对于 `mem_heap_lo()`
- * 的偏移量。这里，`mem_heap_lo()` 是堆模拟器的基指针，恒为 `0x800000000`。
+ * 的倍数。这表示前驱节点的指针相对于 `heap_base_ptr`
+ * 的偏移量。使用 memlib 时，`heap_base_ptr` 是堆模拟器的基指针，恒为
+ * `0x800000000`; 使用 vmem 后端时，它是块所在区域 (或 mm_heap_create
+ * 创建的堆) 的保留区的起点，在进程内不会移动。
  *
- * `next offset` 同理，表示的是后继节点相对堆模拟器基指针的偏移量。
+ * `next offset` 同理，表示的是后继节点相对堆基指针的偏移量。
  */
 
 // 用于优化分支预测.
@@ -60,6 +102,204 @@
 // 常量.
 #define WORD_SIZE 4
 #define EXTEND_SIZE 4096
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+#define HUGE_PAGE_SIZE (2u << 20)
+// 32 位偏移量能表示的最大的堆.
+#define HEAP_MAX_SIZE (1ull << 32)
+
+// 扩展堆的策略.
+// EXTEND_GEOMETRIC 为 0 时, 只扩展恰好需要的大小, 分配时至少 EXTEND_SIZE.
+// memlib 下默认如此, 堆最紧凑.
+// 为 1 时, 每次扩展的粒度取 EXTEND_SIZE << extend_level 与堆大小的
+// 1 / 2^EXTEND_SHIFT 中较大的那个, 但不超过 EXTEND_MAX_SIZE.
+// 两次扩展之间的请求少于 EXTEND_DECAY_COUNT 个时, extend_level 加一;
+// 每多隔 EXTEND_DECAY_COUNT 个请求, extend_level 减一. mm_trim 归还堆尾后清零.
+#ifndef EXTEND_GEOMETRIC
+#define EXTEND_GEOMETRIC (MM_BACKEND == MM_BACKEND_VMEM)
+#endif
+#ifndef EXTEND_DECAY_COUNT
+#define EXTEND_DECAY_COUNT 256
+#endif
+#ifndef EXTEND_SHIFT
+#define EXTEND_SHIFT 3
+#endif
+#ifndef EXTEND_MAX_SIZE
+#define EXTEND_MAX_SIZE (64u << 20)
+#endif
+#define EXTEND_MAX_LEVEL 14
+// 使用大页时, 每次至少扩展一个大页, 小块会先填满一个大页再用下一个.
+#if MM_HUGE_PAGES != MM_HUGE_PAGES_NONE
+#define EXTEND_MIN_SIZE HUGE_PAGE_SIZE
+#else
+#define EXTEND_MIN_SIZE EXTEND_SIZE
+#endif
+
+// 大小不小于 2^(31 - TREE_INDEX), 即索引不超过 TREE_INDEX 的空闲块不放在链表里,
+// 而是放在一棵以 (size, 地址) 为键的 treap 里, 按最佳适配分配.
+// 可以取 0 到 27. 链表的头节点只有 12 到 27 号, TREE_INDEX 小于 11 时,
+// 索引在 TREE_INDEX 和 12 之间的块也放在 12 号链表中.
+#ifndef TREE_INDEX
+#define TREE_INDEX 12
+#endif
+#if TREE_INDEX < 0 || TREE_INDEX > 27
+#error "TREE_INDEX must be between 0 and 27"
+#endif
+
+// 空闲链表默认的插入策略, 见 mm_ext.h 中的 MM_INSERT_*.
+// 可以用 mm_set_insert_policy 为每个大小类单独设置.
+#ifndef INSERT_POLICY
+#define INSERT_POLICY MM_INSERT_FIFO
+#endif
+// MM_INSERT_SIZE 插入时最多向后看多少个节点.
+#ifndef INSERT_SORT_LIMIT
+#define INSERT_SORT_LIMIT 16
+#endif
+
+// 分配时在链表中最多看 FIT_SCAN_LIMIT 个放得下的块, 选剩余部分危害最小的.
+// 为 1 时就是首次适配. 可以用 mm_init_options.fit_scan_limit 覆盖.
+#ifndef FIT_SCAN_LIMIT
+#define FIT_SCAN_LIMIT 1
+#endif
+// 不超过 SPLIT_HIGH_MAX_SIZE 的请求从空闲块的高地址一端切出来, 更大的从低地址一端.
+// 这样小的长寿对象不会落在大空闲块的中间. 为 0 时总是从低地址一端切.
+#ifndef SPLIT_HIGH_MAX_SIZE
+#define SPLIT_HIGH_MAX_SIZE 0
+#endif
+// 为 1 时, 堆尾的空闲块 (荒野块) 只在没有别的块放得下时才使用,
+// 并且从低地址一端切. 这样它尽量保持完整, 能被 mm_trim 归还,
+// 也能让堆尾的块原地 realloc. 但为了留着它, 要先合并快速链表里的块,
+// 空间利用率反而略低, 所以默认关闭, 荒野块和别的空闲块一样参与适配.
+#ifndef PRESERVE_WILDERNESS
+#define PRESERVE_WILDERNESS 0
+#endif
+// 记住最近多少次请求的大小.
+#define RECENT_SIZE_COUNT 8
+// 切分阈值.
+// 剩余部分小于最近请求过的最小的块时, 切出来也没人用, 不如留在已分配的块里.
+// 阈值取最近 SPLIT_WINDOW 次请求中最小的大小, 但不超过 SPLIT_MAX_THRESHOLD,
+// 这样浪费在块里的空间是有界的.
+#ifndef SPLIT_WINDOW
+#define SPLIT_WINDOW 4096
+#endif
+#ifndef SPLIT_MAX_THRESHOLD
+#define SPLIT_MAX_THRESHOLD 64
+#endif
+
+// 快速链表.
+// 不超过 QUICK_MAX_SIZE 的块被释放时, 先按精确的大小挂在快速链表上,
+// 不合并, 仍然标记为已分配. 同样大小的 mm_malloc 直接取走它.
+// 某个快速链表超过 QUICK_LIST_LENGTH, 或者找不到合适的空闲块时,
+// 才真正释放并合并. QUICK_MAX_SIZE 为 0 时不使用快速链表.
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 512
+#endif
+#ifndef QUICK_LIST_LENGTH
+#define QUICK_LIST_LENGTH 32
+#endif
+#define QUICK_COUNT (QUICK_MAX_SIZE / 8 + 1)
+
+// 热点大小.
+// 超过 QUICK_MAX_SIZE, 不超过 HOT_MAX_SIZE 的请求, 每 HOT_SAMPLE_PERIOD 次采样一次,
+// 记入一个 count-min sketch. 最常见的 HOT_BIN_COUNT 种大小各占一个快速链表,
+// 挂在普通快速链表之后, 用法完全相同. 一种大小被挤出时, 它的链表被清空.
+#ifndef HOT_BIN_COUNT
+#define HOT_BIN_COUNT 4
+#endif
+#ifndef HOT_MAX_SIZE
+#define HOT_MAX_SIZE (64u << 10)
+#endif
+#ifndef HOT_SAMPLE_PERIOD
+#define HOT_SAMPLE_PERIOD 8
+#endif
+// sketch 每行 2^HOT_SKETCH_BITS 个计数器, 共两行.
+#define HOT_SKETCH_BITS 6
+// 每采样这么多次, 所有计数减半, 旧的热点会慢慢冷下去.
+#define HOT_DECAY_PERIOD 1024
+#define QUICK_SLOT_COUNT (QUICK_COUNT + HOT_BIN_COUNT)
+// 最小的块是 16 bytes, 下标 0 和 1 不会有块.
+// QUICK_MAX_SIZE 为 0 时, 第一个热点大小的链表就是 1.
+#define QUICK_FIRST_SLOT (QUICK_COUNT < 2 ? QUICK_COUNT : 2)
+
+// mm_malloc_near 沿着 hint 向后最多看多少个块.
+#ifndef NEAR_SCAN_LIMIT
+#define NEAR_SCAN_LIMIT 16
+#endif
+
+// 一个块被 mm_realloc 变大 GROW_TAIL_COUNT 次以后, 下次搬家就搬到堆尾,
+// 之后的增长都可以原地完成. 次数记在一张 2^GROW_TABLE_BITS 项的直接映射表里,
+// 冲突时直接覆盖, 记错了也只是影响放在哪里.
+#ifndef GROW_TAIL_COUNT
+#define GROW_TAIL_COUNT 2
+#endif
+#define GROW_TABLE_BITS 8
+// mm_reserve 记录预留了空间的块, 也是直接映射表.
+#define RESERVE_TABLE_BITS 8
+
+// 复制或清零不少于 STREAM_THRESHOLD 字节时, 使用非临时写入, 不经过缓存,
+// 免得把调用者的工作集挤出去. 按 CPU 支持的指令集选择 AVX2 或 SSE2 的实现.
+#ifndef STREAM_THRESHOLD
+#define STREAM_THRESHOLD (256u << 10)
+#endif
+
+// 区域.
+// SEGREGATE_REGIONS 为 1 时, 小块和不小于 REGION_LARGE_MIN_SIZE 的大块
+// 分别在两个区域中分配. 区域有自己的增长指针, 空闲链表和树, 块只在区域内合并,
+// 小块的反复分配释放不会把大块的空间弄碎.
+// 需要 vmem 后端: 每个区域保留 4 GiB, 依次排列, 由地址就能算出块所在的区域.
+#ifndef SEGREGATE_REGIONS
+#define SEGREGATE_REGIONS 0
+#endif
+#ifndef REGION_LARGE_MIN_SIZE
+#define REGION_LARGE_MIN_SIZE 4096
+#endif
+
+// LIFETIME_REGIONS 为 1 时, mm_malloc_hint 把长寿的和永久的对象
+// 各自放在一个区域中, 不和短命对象混在一起. 需要 vmem 后端, 默认关闭;
+// 关闭时, mm_malloc_hint 与 mm_malloc 相同.
+// 这两个区域不参与 mm_init_ex 的预先扩展, 也没有后台储备.
+#ifndef LIFETIME_REGIONS
+#define LIFETIME_REGIONS 0
+#endif
+
+#define REGION_SMALL 0
+#define REGION_LARGE 1
+
+#if SEGREGATE_REGIONS
+#define REGION_DEFAULT_COUNT 2
+#else
+#define REGION_DEFAULT_COUNT 1
+#endif
+
+#define REGION_LONG_LIVED REGION_DEFAULT_COUNT
+#define REGION_PERMANENT (REGION_DEFAULT_COUNT + 1)
+
+#if LIFETIME_REGIONS
+#define REGION_COUNT (REGION_DEFAULT_COUNT + 2)
+#else
+#define REGION_COUNT REGION_DEFAULT_COUNT
+#endif
+
+#if REGION_COUNT > 1 && MM_BACKEND != MM_BACKEND_VMEM
+#error "SEGREGATE_REGIONS and LIFETIME_REGIONS require MM_BACKEND_VMEM"
+#endif
+
+// 托儿所.
+// NURSERY 为 1 时, 不超过 NURSERY_MAX_SIZE 的请求从一个 NURSERY_CHUNK_SIZE
+// 大小的 chunk 中移动指针分配. chunk 本身是堆中的一个已分配的块,
+// 记录其中还活着的对象数. 对象不单独释放, 只让计数减一;
+// 计数归零时, 当前的 chunk 从头开始重用, 已经用完的 chunk 整个释放.
+// 每个对象前多 8 字节: 所在 chunk 的偏移量, 以及带 NURSERY 标志的 header.
+#ifndef NURSERY
+#define NURSERY 0
+#endif
+#ifndef NURSERY_MAX_SIZE
+#define NURSERY_MAX_SIZE 256
+#endif
+#ifndef NURSERY_CHUNK_SIZE
+#define NURSERY_CHUNK_SIZE (64u << 10)
+#endif
 
 #define FREE 0
 #define ALLOCATED 1
@@ -67,13 +307,491 @@
 #define FORWARD_FREE 0
 #define FORWARD_ALLOCATED 2
 
+#define NURSERY_OBJECT 4
+
+#if MM_BACKEND == MM_BACKEND_VMEM
+// 每个区域保留 4 GiB, 恰好是 32 位偏移量能表示的范围.
+#define VMEM_RESERVE_SIZE HEAP_MAX_SIZE
+// 每次提交的粒度. 使用大页时是一个大页, 归还时也不会拆开大页.
+#ifndef VMEM_COMMIT_SIZE
+#if MM_HUGE_PAGES != MM_HUGE_PAGES_NONE
+#define VMEM_COMMIT_SIZE HUGE_PAGE_SIZE
+#else
+#define VMEM_COMMIT_SIZE (64u << 10)
+#endif
+#endif
+
+// 所有区域的保留区的起点.
+static char *vmem_base = NULL;
+
+// 后台线程在每个区域的 [brk, commit) 中保持至少 vmem_reserve_size
+// 字节已提交并且已经产生过缺页的内存, 这样前台扩展堆时只需要移动 brk.
+// commit 的修改由 vmem_lock 保护; 前台只读 commit 时不加锁.
+// brk 只由前台修改.
+static size_t vmem_reserve_size = 0;
+static int vmem_reserve_running = 0;
+static int vmem_reserve_stopping = 0;
+static pthread_t vmem_reserve_thread;
+static pthread_mutex_t vmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vmem_reserve_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+// 一个区域是一段独立的堆. mm_heap_create 创建的堆也是一个区域.
+struct mm_heap
+{
+    // 基指针. 链表和树中的偏移量都相对于它.
+    char *base;
+    // 堆尾.
+    void *last_ptr;
+    unsigned int extend_level;
+    // 上次扩展以来的请求数.
+    unsigned int extend_clock;
+    // 从基指针开始被 mlock 的字节数.
+    size_t locked_size;
+    void *begins[32];
+    // 按地址排序的链表中, 最近一次插入的位置. 插入时从这里开始向后找.
+    void *fingers[32];
+    // 每个链表中空闲块大小的上界. 插入时更新; 删除时不变, 所以可能偏大;
+    // 完整地扫描一遍链表以后, 它又变成准确值.
+    unsigned int max_free_size[32];
+    void *tree_root;
+    // 下标是大小除以 8; QUICK_COUNT 之后是热点大小的链表.
+    void *quick_heads[QUICK_SLOT_COUNT];
+    unsigned int quick_lengths[QUICK_SLOT_COUNT];
+    // 所有快速链表中块的总数.
+    unsigned int quick_total;
+    // 托儿所正在分配的 chunk.
+    void *nursery;
+    // 最近一次被搬到堆尾的一直在变大的块. 可能已经释放了, 只用来做判断.
+    void *tail_grower;
+    // mm_heap_create 创建的堆串成一个链表.
+    struct mm_heap *next_instance;
+#if MM_BACKEND == MM_BACKEND_VMEM
+    char *brk;
+    char *commit;
+#endif
+};
+
+static struct mm_heap heaps[REGION_COUNT];
+// mm_heap_create 创建的堆.
+static struct mm_heap *instances = NULL;
+// 正在操作的区域. 每个接口函数在开始时设置它.
+static struct mm_heap *heap = &heaps[0];
+
 // Heap 的基指针.
-#define heap_base_ptr (void *)0x800000000ull
+#define heap_base_ptr ((void *)heap->base)
 
-static void *heap_last_ptr = heap_base_ptr;
-static void **begins = NULL;
 static unsigned int *list_min_block_size = NULL;
 static unsigned int *list_max_block_size = NULL;
+static unsigned char list_insert_policy[32];
+static unsigned int fit_scan_limit = FIT_SCAN_LIMIT;
+static unsigned int recent_sizes[RECENT_SIZE_COUNT];
+static unsigned int recent_cursor = 0;
+// 剩余部分不小于 split_threshold 时才切分.
+static unsigned int split_threshold = 16;
+// 这一轮窗口中请求过的最小的大小, 以及请求的次数.
+static unsigned int split_window_min = SPLIT_MAX_THRESHOLD;
+static unsigned int split_window_count = 0;
+// 热点大小, 0 表示空闲; 以及它们在 sketch 中的估计值.
+static unsigned int hot_sizes[HOT_BIN_COUNT];
+static unsigned int hot_counts[HOT_BIN_COUNT];
+static unsigned short hot_sketch[2][1 << HOT_SKETCH_BITS];
+static unsigned int hot_ticks = 0;
+static unsigned int hot_samples = 0;
+// 块的地址 (除以 8), 以及它被 mm_realloc 变大的次数.
+static unsigned int grow_keys[1 << GROW_TABLE_BITS];
+static unsigned char grow_counts[1 << GROW_TABLE_BITS];
+// 预留了空间的块的地址 (除以 8), 以及预留以后的块大小.
+static unsigned int reserve_keys[1 << RESERVE_TABLE_BITS];
+static unsigned int reserve_sizes[1 << RESERVE_TABLE_BITS];
+
+// 非临时写入的复制和清零. dst 先按向量宽度对齐, 头尾用 memcpy/memset 处理.
+__attribute__((target("sse2"))) static void
+stream_copy_sse2(void *dst, const void *src, size_t size)
+{
+    char *d = dst;
+    const char *s = src;
+    size_t head = -(uintptr_t)d & 15;
+    if (head > size)
+        head = size;
+    memcpy(d, s, head);
+    d += head, s += head, size -= head;
+    for (; size >= 64; d += 64, s += 64, size -= 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, size);
+}
+
+__attribute__((target("avx2"))) static void
+stream_copy_avx2(void *dst, const void *src, size_t size)
+{
+    char *d = dst;
+    const char *s = src;
+    size_t head = -(uintptr_t)d & 31;
+    if (head > size)
+        head = size;
+    memcpy(d, s, head);
+    d += head, s += head, size -= head;
+    for (; size >= 128; d += 128, s += 128, size -= 128)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, size);
+}
+
+__attribute__((target("sse2"))) static void stream_zero_sse2(void *dst,
+                                                             size_t size)
+{
+    char *d = dst;
+    size_t head = -(uintptr_t)d & 15;
+    if (head > size)
+        head = size;
+    memset(d, 0, head);
+    d += head, size -= head;
+    const __m128i zero = _mm_setzero_si128();
+    for (; size >= 64; d += 64, size -= 64)
+    {
+        _mm_stream_si128((__m128i *)d, zero);
+        _mm_stream_si128((__m128i *)(d + 16), zero);
+        _mm_stream_si128((__m128i *)(d + 32), zero);
+        _mm_stream_si128((__m128i *)(d + 48), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, size);
+}
+
+__attribute__((target("avx2"))) static void stream_zero_avx2(void *dst,
+                                                             size_t size)
+{
+    char *d = dst;
+    size_t head = -(uintptr_t)d & 31;
+    if (head > size)
+        head = size;
+    memset(d, 0, head);
+    d += head, size -= head;
+    const __m256i zero = _mm256_setzero_si256();
+    for (; size >= 128; d += 128, size -= 128)
+    {
+        _mm256_stream_si256((__m256i *)d, zero);
+        _mm256_stream_si256((__m256i *)(d + 32), zero);
+        _mm256_stream_si256((__m256i *)(d + 64), zero);
+        _mm256_stream_si256((__m256i *)(d + 96), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, size);
+}
+
+// mm_init 按 CPU 支持的指令集选择.
+static void (*stream_copy)(void *, const void *, size_t) = stream_copy_sse2;
+static void (*stream_zero)(void *, size_t) = stream_zero_sse2;
+
+// 选择非临时写入的实现.
+static void stream_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        stream_copy = stream_copy_avx2;
+        stream_zero = stream_zero_avx2;
+    }
+    else
+    {
+        stream_copy = stream_copy_sse2;
+        stream_zero = stream_zero_sse2;
+    }
+}
+
+// 复制 size 字节. 足够大时不经过缓存.
+static inline void copy_payload(void *dst, const void *src, size_t size)
+{
+    if (size >= STREAM_THRESHOLD)
+        stream_copy(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
+// 清零 size 字节. 足够大时不经过缓存.
+static inline void zero_payload(void *dst, size_t size)
+{
+    if (size >= STREAM_THRESHOLD)
+        stream_zero(dst, size);
+    else
+        memset(dst, 0, size);
+}
+
+// 让 [begin, end) 中的每一页都真正被映射.
+static void heap_prefault(void *begin, void *end)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(begin, (char *)end - (char *)begin, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    // 内核不支持的话, 就一页一页地摸一下. 写回原值, 不破坏堆的内容.
+    for (volatile char *ptr = begin; ptr < (char *)end; ptr += PAGE_SIZE)
+        *ptr = *ptr;
+}
+
+#if MM_BACKEND == MM_BACKEND_VMEM
+// 把区域 h 的 [commit, end) 提交为可读写. 需要持有 vmem_lock.
+// prefault 非 0 时, 先产生缺页, 再让前台看到这段内存.
+static int vmem_commit_to(struct mm_heap *h, char *end, int prefault)
+{
+    char *const begin = h->commit;
+    size_t size = (size_t)(end - begin + VMEM_COMMIT_SIZE - 1) &
+                  ~(size_t)(VMEM_COMMIT_SIZE - 1);
+    if (size > VMEM_RESERVE_SIZE - (size_t)(begin - h->base))
+        size = VMEM_RESERVE_SIZE - (size_t)(begin - h->base);
+#if MM_HUGE_PAGES == MM_HUGE_PAGES_HUGETLB && defined(MAP_HUGETLB)
+    // 大页池不够时 mmap 会失败, 而且原来的映射可能已经没了.
+    // 这时重新映射, 退回透明大页.
+    if (mmap(begin, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1,
+             0) == MAP_FAILED)
+    {
+        if (mmap(begin, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+                 0) == MAP_FAILED)
+            return -1;
+        madvise(begin, size, MADV_HUGEPAGE);
+    }
+#else
+    if (mprotect(begin, size, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+#endif
+    if (prefault)
+        heap_prefault(begin, begin + size);
+    __atomic_store_n(&h->commit, begin + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// 归还区域 h 的 [begin, commit) 的物理页, 并重新设为不可访问.
+static void vmem_decommit_from(struct mm_heap *h, char *begin)
+{
+    begin = h->base + (((size_t)(begin - h->base) + VMEM_COMMIT_SIZE - 1) &
+                       ~(size_t)(VMEM_COMMIT_SIZE - 1));
+    pthread_mutex_lock(&vmem_lock);
+    if (begin < h->commit)
+    {
+#if MM_HUGE_PAGES == MM_HUGE_PAGES_HUGETLB
+        // MAP_HUGETLB 的映射只能整个换掉.
+        mmap(begin, h->commit - begin, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+#else
+        madvise(begin, h->commit - begin, MADV_DONTNEED);
+        mprotect(begin, h->commit - begin, PROT_NONE);
+#endif
+        __atomic_store_n(&h->commit, begin, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&vmem_lock);
+}
+
+// 与 mem_sbrk 相同的语义, 但是作用于区域 h, 并且 incr 可以为负.
+static void *vmem_sbrk(struct mm_heap *h, intptr_t incr)
+{
+    char *const old_brk = h->brk;
+    char *const new_brk = old_brk + incr;
+
+    if (incr > 0)
+    {
+        if (unlikely((size_t)incr > VMEM_RESERVE_SIZE -
+                                        (size_t)(old_brk - h->base)))
+            return (void *)-1;
+
+        // 后台线程没跟上, 只好自己提交.
+        if (new_brk > __atomic_load_n(&h->commit, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&vmem_lock);
+            int failed = new_brk > h->commit && vmem_commit_to(h, new_brk, 0);
+            pthread_mutex_unlock(&vmem_lock);
+            if (unlikely(failed))
+                return (void *)-1;
+        }
+    }
+    else if (incr < 0)
+    {
+        if (unlikely((size_t)-incr > (size_t)(old_brk - h->base)))
+            return (void *)-1;
+        vmem_decommit_from(h, new_brk);
+    }
+
+    __atomic_store_n(&h->brk, new_brk, __ATOMIC_RELAXED);
+
+    // 储备不足了, 叫醒后台线程.
+    if (vmem_reserve_running && h < heaps + REGION_DEFAULT_COUNT &&
+        (size_t)(__atomic_load_n(&h->commit, __ATOMIC_RELAXED) - new_brk) <
+            vmem_reserve_size)
+        pthread_cond_signal(&vmem_reserve_cond);
+
+    return old_brk;
+}
+
+// 后台线程: 某个默认区域的储备低于 vmem_reserve_size 时, 把它补到两倍.
+// 前台的唤醒可能丢失, 所以最多睡 10ms 就检查一次.
+static void *vmem_reserve_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&vmem_lock);
+    while (!vmem_reserve_stopping)
+    {
+        for (struct mm_heap *h = heaps; h < heaps + REGION_DEFAULT_COUNT; h++)
+        {
+            char *brk = __atomic_load_n(&h->brk, __ATOMIC_RELAXED);
+            if ((size_t)(h->commit - brk) < vmem_reserve_size &&
+                (size_t)(h->commit - h->base) < VMEM_RESERVE_SIZE)
+                vmem_commit_to(h, brk + 2 * vmem_reserve_size, 1);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10 * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000 * 1000 * 1000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&vmem_reserve_cond, &vmem_lock, &deadline);
+    }
+    pthread_mutex_unlock(&vmem_lock);
+    return NULL;
+}
+
+// 启动后台线程. 出错时返回 -1, 成功时返回 0.
+static int vmem_reserve_start(size_t reserve_size)
+{
+    vmem_reserve_size = reserve_size;
+    vmem_reserve_stopping = 0;
+    if (pthread_create(&vmem_reserve_thread, NULL, vmem_reserve_main, NULL) !=
+        0)
+        return -1;
+    vmem_reserve_running = 1;
+    return 0;
+}
+
+// 停止后台线程.
+static void vmem_reserve_stop(void)
+{
+    if (!vmem_reserve_running)
+        return;
+    pthread_mutex_lock(&vmem_lock);
+    vmem_reserve_stopping = 1;
+    pthread_cond_signal(&vmem_reserve_cond);
+    pthread_mutex_unlock(&vmem_lock);
+    pthread_join(vmem_reserve_thread, NULL);
+    vmem_reserve_running = 0;
+}
+#endif
+
+// 初始化后端. 第一次调用时保留地址空间, 之后的调用把所有区域清空.
+#if MM_BACKEND == MM_BACKEND_VMEM
+// 保留 reserve_size 字节的地址空间, 起点对齐到提交的粒度.
+// 失败时返回 NULL.
+static char *vmem_reserve(size_t reserve_size)
+{
+    // 多保留一些, 以便把起点对齐到提交的粒度.
+    size_t size = reserve_size + VMEM_COMMIT_SIZE;
+    char *base = mmap(NULL, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    char *aligned_base = (char *)(((uintptr_t)base + VMEM_COMMIT_SIZE - 1) &
+                                  ~(uintptr_t)(VMEM_COMMIT_SIZE - 1));
+    if (aligned_base != base)
+        munmap(base, aligned_base - base);
+    munmap(aligned_base + reserve_size,
+           base + size - (aligned_base + reserve_size));
+
+#if MM_HUGE_PAGES != MM_HUGE_PAGES_NONE
+    madvise(aligned_base, reserve_size, MADV_HUGEPAGE);
+#endif
+    return aligned_base;
+}
+#endif
+
+static inline int heap_backend_init(void)
+{
+#if MM_BACKEND == MM_BACKEND_VMEM
+    if (vmem_base == NULL)
+    {
+        vmem_base = vmem_reserve(VMEM_RESERVE_SIZE * REGION_COUNT);
+        if (vmem_base == NULL)
+            return -1;
+        for (size_t i = 0; i < REGION_COUNT; i++)
+            heaps[i].base = heaps[i].brk = heaps[i].commit =
+                vmem_base + i * VMEM_RESERVE_SIZE;
+        return 0;
+    }
+    vmem_reserve_stop();
+    for (struct mm_heap *h = heaps; h < heaps + REGION_COUNT; h++)
+    {
+        vmem_decommit_from(h, h->base);
+        h->brk = h->base;
+    }
+#else
+    heaps[0].base = (char *)0x800000000ull;
+#endif
+    return 0;
+}
+
+// 大小为 aligned_size 的块应当在哪个区域中分配.
+static inline struct mm_heap *heap_for(unsigned int aligned_size)
+{
+#if SEGREGATE_REGIONS
+    return &heaps[aligned_size >= REGION_LARGE_MIN_SIZE ? REGION_LARGE
+                                                        : REGION_SMALL];
+#else
+    (void)aligned_size;
+    return &heaps[0];
+#endif
+}
+
+// 找到 ptr 所在的区域, 包括 mm_heap_create 创建的堆.
+static inline struct mm_heap *heap_of(void *ptr)
+{
+#if MM_BACKEND == MM_BACKEND_VMEM
+    size_t offset = (size_t)((char *)ptr - vmem_base);
+    if (likely(offset < (size_t)VMEM_RESERVE_SIZE * REGION_COUNT))
+        return &heaps[offset / VMEM_RESERVE_SIZE];
+
+    // 不在默认的区域里, 只能是某个独立的堆中的块.
+    struct mm_heap *h = instances;
+    while (h != NULL &&
+           (size_t)((char *)ptr - h->base) >= (size_t)VMEM_RESERVE_SIZE)
+        h = h->next_instance;
+    return h;
+#else
+    (void)ptr;
+    return &heaps[0];
+#endif
+}
+
+// extend_heap, mm_realloc 和 mm_trim 通过它扩展或收缩堆.
+// 失败时返回 (void *)-1.
+static inline void *heap_sbrk(intptr_t incr)
+{
+#if MM_BACKEND == MM_BACKEND_VMEM
+    return vmem_sbrk(heap, incr);
+#else
+    return mem_sbrk(incr);
+#endif
+}
 
 // 从 ptr 读一个字.
 static inline unsigned int read_word(void *ptr) { return *(unsigned int *)ptr; }
@@ -134,9 +852,10 @@ static inline void set_next(void *ptr, void *next)
 
 // 设置 size, flag 不变.
 // 同时改变 header 和 footer
+// 新块的 header 可能来自原来的数据, 所以 NURSERY_OBJECT 总是被清除.
 static inline void set_size(void *ptr, unsigned int size)
 {
-    unsigned int flag = get_header(ptr) & 0x7;
+    unsigned int flag = get_header(ptr) & (ALLOCATED | FORWARD_ALLOCATED);
     set_header(ptr, size | flag);
     write_word((char *)ptr + size - 2 * WORD_SIZE, size);
 }
@@ -145,7 +864,7 @@ static inline void set_size(void *ptr, unsigned int size)
 // 只改变 header
 static inline void set_size_only_header(void *ptr, unsigned int size)
 {
-    unsigned int flag = get_header(ptr) & 0x7;
+    unsigned int flag = get_header(ptr) & (ALLOCATED | FORWARD_ALLOCATED);
     set_header(ptr, size | flag);
 }
 
@@ -188,14 +907,16 @@ static inline int is_forward_allocated(void *ptr)
     return (get_header(ptr) & FORWARD_ALLOCATED) == FORWARD_ALLOCATED;
 }
 
-// 从 ptr 所属的链表中，删除 ptr.
-static inline void delete_block(void *ptr)
+// 是托儿所中的对象吗?
+static inline int is_nursery_object(void *ptr)
 {
-    void *prev = get_prev(ptr);
-    void *next = get_next(ptr);
+    return (get_header(ptr) & NURSERY_OBJECT) == NURSERY_OBJECT;
+}
 
-    set_next(prev, next);
-    set_prev(next, prev);
+// 块 ptr 中可以使用的字节数.
+static inline unsigned int get_payload_size(void *ptr)
+{
+    return get_size(ptr) - (is_nursery_object(ptr) ? 3 : 1) * WORD_SIZE;
 }
 
 // 返回值范围是 0 到 32
@@ -207,13 +928,242 @@ static inline unsigned int get_index(unsigned int aligned_size)
     return ans;
 }
 
+// 大小类 index 的空闲块放在哪个链表里.
+// 不到 12 的大小类没有自己的头节点, 和 12 共用一个链表,
+// 链表上的指针和策略都记在 12 上. 只有 TREE_INDEX 小于 11 时才会用到.
+static inline unsigned int get_list(unsigned int index)
+{
+    return index < 12 ? 12 : index;
+}
+
+/**
+ * 树中的块复用 `prev offset` 和 `next offset` 两个字,
+ * 分别存放左孩子和右孩子相对堆基指针的偏移量, 0 表示没有.
+ * 堆性质使用的优先级由块的地址散列得到, 不需要额外的空间.
+ */
+
+// 获得左孩子.
+static inline void *get_left(void *ptr)
+{
+    unsigned int offset = read_word(ptr);
+    return offset == 0 ? NULL : (char *)heap_base_ptr + offset;
+}
+
+// 获得右孩子.
+static inline void *get_right(void *ptr)
+{
+    unsigned int offset = read_word((char *)ptr + WORD_SIZE);
+    return offset == 0 ? NULL : (char *)heap_base_ptr + offset;
+}
+
+// 设置左孩子.
+static inline void set_left(void *ptr, void *left)
+{
+    write_word(ptr, left == NULL ? 0 : (char *)left - (char *)heap_base_ptr);
+}
+
+// 设置右孩子.
+static inline void set_right(void *ptr, void *right)
+{
+    write_word((char *)ptr + WORD_SIZE,
+               right == NULL ? 0 : (char *)right - (char *)heap_base_ptr);
+}
+
+// 树节点的优先级.
+static inline unsigned int tree_priority(void *ptr)
+{
+    unsigned int x = (unsigned int)((char *)ptr - (char *)heap_base_ptr) >> 3;
+    x *= 0x9e3779b1u;
+    return x ^ (x >> 15);
+}
+
+// 大小为 size 的块 ptr 的键是否小于节点 node 的键?
+static inline int tree_less(void *ptr, unsigned int size, void *node)
+{
+    unsigned int node_size = get_size(node);
+    return size < node_size || (size == node_size && ptr < node);
+}
+
+// 把子树 tree 分成键小于 (size, ptr) 的 *left 和其余的 *right.
+static void tree_split(void *tree, void *ptr, unsigned int size, void **left,
+                       void **right)
+{
+    if (tree == NULL)
+    {
+        *left = *right = NULL;
+        return;
+    }
+    if (tree != ptr && !tree_less(ptr, size, tree))
+    {
+        tree_split(get_right(tree), ptr, size, left, right);
+        set_right(tree, *left);
+        *left = tree;
+    }
+    else
+    {
+        tree_split(get_left(tree), ptr, size, left, right);
+        set_left(tree, *right);
+        *right = tree;
+    }
+}
+
+// 合并两棵子树, left 中的键都小于 right 中的键.
+static void *tree_merge(void *left, void *right)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+    if (tree_priority(left) > tree_priority(right))
+    {
+        set_right(left, tree_merge(get_right(left), right));
+        return left;
+    }
+    set_left(right, tree_merge(left, get_left(right)));
+    return right;
+}
+
+// 把大小为 size 的块 ptr 插入子树 tree, 返回新的子树.
+static void *tree_insert(void *tree, void *ptr, unsigned int size)
+{
+    if (tree == NULL || tree_priority(ptr) > tree_priority(tree))
+    {
+        void *left, *right;
+        tree_split(tree, ptr, size, &left, &right);
+        set_left(ptr, left);
+        set_right(ptr, right);
+        return ptr;
+    }
+    if (tree_less(ptr, size, tree))
+        set_left(tree, tree_insert(get_left(tree), ptr, size));
+    else
+        set_right(tree, tree_insert(get_right(tree), ptr, size));
+    return tree;
+}
+
+// 从子树 tree 中删除大小为 size 的块 ptr, 返回新的子树.
+static void *tree_delete(void *tree, void *ptr, unsigned int size)
+{
+    if (tree == ptr)
+        return tree_merge(get_left(tree), get_right(tree));
+    if (tree_less(ptr, size, tree))
+        set_left(tree, tree_delete(get_left(tree), ptr, size));
+    else
+        set_right(tree, tree_delete(get_right(tree), ptr, size));
+    return tree;
+}
+
+// 找到不小于 aligned_size 的最小的块. 一样大时取地址最小的.
+static inline void *tree_find(unsigned int aligned_size)
+{
+    void *best = NULL;
+    for (void *node = heap->tree_root; node != NULL;)
+    {
+        if (get_size(node) >= aligned_size)
+        {
+            best = node;
+            node = get_left(node);
+        }
+        else
+            node = get_right(node);
+    }
+    return best;
+}
+
+// 找到键比 (size, ptr) 大的最小的块.
+static inline void *tree_find_after(void *ptr, unsigned int size)
+{
+    void *best = NULL;
+    for (void *node = heap->tree_root; node != NULL;)
+    {
+        if (tree_less(ptr, size, node))
+        {
+            best = node;
+            node = get_left(node);
+        }
+        else
+            node = get_right(node);
+    }
+    return best;
+}
+
+// 从 ptr 所属的链表 (或树) 中，删除 ptr.
+static inline void delete_block(void *ptr)
+{
+    unsigned int size = get_size(ptr);
+    if (get_index(size) <= TREE_INDEX)
+    {
+        heap->tree_root = tree_delete(heap->tree_root, ptr, size);
+        return;
+    }
+
+    void *prev = get_prev(ptr);
+    void *next = get_next(ptr);
+
+    set_next(prev, next);
+    set_prev(next, prev);
+
+    unsigned int list = get_list(get_index(size));
+    if (heap->fingers[list] == ptr)
+        heap->fingers[list] = prev;
+}
+
 // 将 size 大小的块 ptr 插入恰当的链表.
 static inline void insert(void *ptr, unsigned int size)
 {
     // 该在哪个链表插入呢?
     unsigned int index = get_index(size);
 
-    void *const end = begins[index];
+    // 大块放在树里.
+    if (index <= TREE_INDEX)
+    {
+        heap->tree_root = tree_insert(heap->tree_root, ptr, size);
+        return;
+    }
+
+    unsigned int list = get_list(index);
+    void *const end = heap->begins[list];
+
+    if (size > heap->max_free_size[list])
+        heap->max_free_size[list] = size;
+
+    // 按地址排序: 找到最后一个地址比 ptr 小的节点, 插在它后面.
+    // 头节点的地址比所有块都小, 指针在 ptr 之后时就从头节点开始.
+    if (list_insert_policy[list] == MM_INSERT_ADDRESS)
+    {
+        void *prev = heap->fingers[list] < ptr ? heap->fingers[list] : end;
+        for (void *next = get_next(prev); next != end && next < ptr;
+             next = get_next(next))
+            prev = next;
+
+        void *const next = get_next(prev);
+        set_prev(ptr, prev);
+        set_next(ptr, next);
+        set_next(prev, ptr);
+        set_prev(next, ptr);
+
+        heap->fingers[list] = ptr;
+        return;
+    }
+
+    // 按大小排序: 插在前 INSERT_SORT_LIMIT 个节点中第一个不比 ptr 小的之前.
+    // 链表再长, 后面的部分就不管顺序了.
+    if (list_insert_policy[list] == MM_INSERT_SIZE)
+    {
+        void *next = get_next(end);
+        for (unsigned int i = 0;
+             i < INSERT_SORT_LIMIT && next != end && get_size(next) < size; i++)
+            next = get_next(next);
+
+        void *const prev = get_prev(next);
+        set_prev(ptr, prev);
+        set_next(ptr, next);
+        set_next(prev, ptr);
+        set_prev(next, ptr);
+        return;
+    }
+
+    // 否则插在链表尾.
     void *const prev = get_prev(end);
 
     set_prev(end, ptr);
@@ -223,6 +1173,49 @@ static inline void insert(void *ptr, unsigned int size)
     set_next(prev, ptr);
 }
 
+// 把块 ptr 挂到第 slot 个快速链表上.
+// 快速链表是单链表, 后继的偏移量存在块的第一个字里, 0 表示结束.
+static inline void quick_push(void *ptr, unsigned int slot)
+{
+    void *const head = heap->quick_heads[slot];
+
+    write_word(ptr, head == NULL ? 0 : (char *)head - (char *)heap_base_ptr);
+    heap->quick_heads[slot] = ptr;
+    heap->quick_lengths[slot]++;
+    heap->quick_total++;
+}
+
+// 从第 slot 个快速链表中取出一个块. 链表为空时返回 NULL.
+static inline void *quick_pop(unsigned int slot)
+{
+    void *const ptr = heap->quick_heads[slot];
+
+    if (ptr == NULL)
+        return NULL;
+
+    unsigned int next = read_word(ptr);
+    heap->quick_heads[slot] = next == 0 ? NULL : (char *)heap_base_ptr + next;
+    heap->quick_lengths[slot]--;
+    heap->quick_total--;
+    return ptr;
+}
+
+// 记录一次大小为 aligned_size 的请求, 调整切分阈值.
+// 阈值立即跟着更小的请求下降; 每个窗口结束时, 才按这个窗口的最小值回升.
+static inline void split_observe(unsigned int aligned_size)
+{
+    if (aligned_size < split_window_min)
+        split_window_min = aligned_size;
+    if (aligned_size < split_threshold)
+        split_threshold = aligned_size;
+    if (++split_window_count >= SPLIT_WINDOW)
+    {
+        split_threshold = split_window_min;
+        split_window_min = SPLIT_MAX_THRESHOLD;
+        split_window_count = 0;
+    }
+}
+
 // 在 ptr 指向的, 大小为 block_size 的空闲块 ptr 中切分出 aligned_size
 // 大小的空间. 这里假定 ptr 已经脱离链表. 剩余的空间将被插入恰当的链表.
 static void *place(unsigned int aligned_size, void *ptr,
@@ -231,8 +1224,8 @@ static void *place(unsigned int aligned_size, void *ptr,
     // 还剩下多少呢?
     unsigned int remain_size = block_size - aligned_size;
 
-    // 不够 16 bytes 了捏.
-    if (remain_size < 16)
+    // 剩下的太小了, 没人会用.
+    if (remain_size < split_threshold)
     {
         set_allocated_flag(ptr);
         set_forward_allocated_flag(get_back(ptr));
@@ -251,6 +1244,34 @@ static void *place(unsigned int aligned_size, void *ptr,
     return ptr;
 }
 
+// 与 place 相同, 但是从高地址一端切出 aligned_size 大小的空间,
+// 低地址的剩余部分留在原处, 插入恰当的链表.
+static void *place_high(unsigned int aligned_size, void *ptr,
+                        unsigned int block_size)
+{
+    unsigned int remain_size = block_size - aligned_size;
+
+    if (remain_size < split_threshold)
+        return place(aligned_size, ptr, block_size);
+
+    set_size(ptr, remain_size);
+    insert(ptr, remain_size);
+
+    void *new_ptr = get_back(ptr);
+    set_header(new_ptr, aligned_size | ALLOCATED | FORWARD_FREE);
+    set_forward_allocated_flag(get_back(new_ptr));
+    return new_ptr;
+}
+
+// 按切分方向的策略, 在空闲块 ptr 中分配 aligned_size 大小的空间.
+static inline void *place_fit(unsigned int aligned_size, void *ptr,
+                              unsigned int block_size)
+{
+    if (aligned_size <= SPLIT_HIGH_MAX_SIZE)
+        return place_high(aligned_size, ptr, block_size);
+    return place(aligned_size, ptr, block_size);
+}
+
 // 计算对齐后的 size.
 // 对齐后小于 16 会自动转化为 16 哦.
 static inline unsigned int align_size(size_t size)
@@ -269,12 +1290,10 @@ static void *shrink(unsigned int aligned_size, void *ptr,
     // 还剩下多少呢?
     unsigned int remain_size = block_size - aligned_size;
 
-    // 不够 16 bytes 了捏.
-    if (remain_size < 16)
+    // 剩下的太小了, 没人会用.
+    if (remain_size < split_threshold)
         return ptr;
 
-    // 还是够 16 bytes 的.
-
     set_size_only_header(ptr, aligned_size);
 
     void *new_back = get_back(ptr);
@@ -300,21 +1319,30 @@ static void *shrink(unsigned int aligned_size, void *ptr,
 
     return ptr;
 }
-// 初始化 mm.
+static int quick_flush_all(void);
+
+// 初始化当前区域: 申请第一段堆, 建立链表头节点和第一个空闲块.
 // 出错时返回 -1, 成功时返回 0.
-// 将被 mdriver 自动调用, 因此不需要从 mm_malloc/mm_free 等显式调用.
-int mm_init(void)
+static int heap_init(void)
 {
-    static void *__list_ptrs[32] = {0};
-    static unsigned int __list_max_block_size[32] = {0};
-    static unsigned int __list_min_block_size[32] = {0};
-
     // 先申请 512 字节的 heap.
-    if (mem_sbrk(EXTEND_SIZE) == (void *)-1)
+    if (heap_sbrk(EXTEND_SIZE) == (void *)-1)
         return -1;
 
-    heap_last_ptr = heap_base_ptr;
-    heap_last_ptr = (char *)heap_last_ptr + EXTEND_SIZE;
+    heap->last_ptr = heap_base_ptr;
+    heap->last_ptr = (char *)heap->last_ptr + EXTEND_SIZE;
+    heap->extend_level = 0;
+    heap->extend_clock = 0;
+
+    for (size_t i = 0; i < QUICK_SLOT_COUNT; i++)
+    {
+        heap->quick_heads[i] = NULL;
+        heap->quick_lengths[i] = 0;
+    }
+    heap->quick_total = 0;
+    heap->tree_root = NULL;
+    heap->nursery = NULL;
+    heap->tail_grower = NULL;
 
     // 前 128 字节将被链表头节点占用.
     for (size_t i = 0; i < 128; i += 8)
@@ -331,96 +1359,542 @@ int mm_init(void)
     set_forward_allocated_flag((char *)heap_base_ptr + 136);
 
     // 堆尾的 4 字节处理一下.
-    set_header(heap_last_ptr, 0 | ALLOCATED | FORWARD_FREE);
-
-    for (size_t i = 12; i <= 27; i++)
-    {
-        __list_min_block_size[i] = 1 << (31 - i);
-        __list_max_block_size[i] = 1 << (32 - i);
-    }
-    __list_max_block_size[12] = 4294967295;
+    set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
 
     for (size_t i = 27, j = 0; i >= 12; i--, j += 8)
-        __list_ptrs[i] = (char *)heap_base_ptr + j;
+        heap->begins[i] = (char *)heap_base_ptr + j;
 
     for (int i = 11; i >= 0; i--)
-        __list_ptrs[i] = (char *)heap_base_ptr + 120;
-    begins = __list_ptrs;
-    list_min_block_size = __list_min_block_size;
-    list_max_block_size = __list_max_block_size;
+        heap->begins[i] = (char *)heap_base_ptr + 120;
 
-    insert((char *)heap_base_ptr + 136, EXTEND_SIZE - 128 - 8);
-    return 0;
+    for (size_t i = 0; i < 32; i++)
+    {
+        heap->fingers[i] = heap->begins[i];
+        heap->max_free_size[i] = 0;
+    }
+
+    insert((char *)heap_base_ptr + 136, EXTEND_SIZE - 128 - 8);
+    return 0;
+}
+
+// 初始化 mm.
+// 出错时返回 -1, 成功时返回 0.
+// 将被 mdriver 自动调用, 因此不需要从 mm_malloc/mm_free 等显式调用.
+int mm_init(void)
+{
+    static unsigned int __list_max_block_size[32] = {0};
+    static unsigned int __list_min_block_size[32] = {0};
+
+    // 上一次 mm_init_ex 锁住的内存要先解锁, 否则后端没法归还.
+    for (heap = heaps; heap < heaps + REGION_COUNT; heap++)
+        if (heap->locked_size != 0)
+        {
+            munlock(heap_base_ptr, heap->locked_size);
+            heap->locked_size = 0;
+        }
+
+    if (heap_backend_init() < 0)
+        return -1;
+
+    stream_select();
+
+    // 热点大小要清空了, 独立的堆中挂在它们上面的块先真正释放.
+    for (heap = instances; heap != NULL; heap = heap->next_instance)
+        quick_flush_all();
+
+    for (size_t i = 12; i <= 27; i++)
+    {
+        __list_min_block_size[i] = 1 << (31 - i);
+        __list_max_block_size[i] = 1 << (32 - i);
+    }
+    __list_max_block_size[12] = 4294967295;
+    list_min_block_size = __list_min_block_size;
+    list_max_block_size = __list_max_block_size;
+
+    for (size_t i = 0; i < 32; i++)
+        list_insert_policy[i] = INSERT_POLICY;
+    fit_scan_limit = FIT_SCAN_LIMIT;
+    split_threshold = 16;
+    split_window_min = SPLIT_MAX_THRESHOLD;
+    split_window_count = 0;
+    memset(hot_sizes, 0, sizeof(hot_sizes));
+    memset(hot_counts, 0, sizeof(hot_counts));
+    memset(hot_sketch, 0, sizeof(hot_sketch));
+    hot_ticks = 0;
+    hot_samples = 0;
+    memset(grow_keys, 0, sizeof(grow_keys));
+    memset(grow_counts, 0, sizeof(grow_counts));
+    memset(reserve_keys, 0, sizeof(reserve_keys));
+    memset(reserve_sizes, 0, sizeof(reserve_sizes));
+
+    for (heap = heaps; heap < heaps + REGION_COUNT; heap++)
+        if (heap_init() < 0)
+            return -1;
+    heap = &heaps[0];
+    return 0;
+}
+
+// 把堆扩展 size 字节, 并入堆尾的空闲块.
+// 出错时返回 -1, 成功时返回 0.
+static int grow_tail(unsigned int size)
+{
+    if (heap_sbrk(size) == (void *)-1)
+        return -1;
+
+    void *block = heap->last_ptr;
+    unsigned int block_size = size;
+
+    // 堆尾已经是空闲块了, 那就合并.
+    if (!is_forward_allocated(heap->last_ptr))
+    {
+        block = get_forward(heap->last_ptr);
+        delete_block(block);
+        block_size += get_size(block);
+    }
+
+    heap->last_ptr = (char *)heap->last_ptr + size;
+    set_size(block, block_size);
+    unset_allocated_flag(block);
+    set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
+    insert(block, block_size);
+    return 0;
+}
+
+// 带选项的 mm_init.
+// 把 options->heap_size 字节平分给默认的区域, 各自预先扩展,
+// 作为一个大的空闲块放入链表,
+// 并按 options->flags 预先产生缺页, 或者锁住这段内存.
+// options->reserve_size 非 0 时启动后台线程, 在堆尾之后保持这么多储备.
+// 出错时返回 -1, 成功时返回 0. options 可以是 NULL.
+int mm_init_ex(const struct mm_init_options *options)
+{
+    if (mm_init() < 0)
+        return -1;
+
+    if (options == NULL)
+        return 0;
+
+    if (options->heap_size >= HEAP_MAX_SIZE)
+        return -1;
+
+    size_t region_size = options->heap_size / REGION_DEFAULT_COUNT;
+    for (heap = heaps; heap < heaps + REGION_DEFAULT_COUNT; heap++)
+    {
+        size_t heap_size = (char *)heap->last_ptr - (char *)heap_base_ptr;
+        if (region_size > heap_size)
+        {
+            size_t grow_size =
+                (region_size - heap_size + PAGE_SIZE - 1) &
+                ~(size_t)(PAGE_SIZE - 1);
+            if (grow_tail(grow_size) < 0)
+                return -1;
+            heap_size += grow_size;
+        }
+
+        if (options->flags & MM_INIT_PREFAULT)
+            heap_prefault(heap_base_ptr, heap->last_ptr);
+
+        if (options->flags & MM_INIT_MLOCK)
+        {
+            if (mlock(heap_base_ptr, heap_size) != 0)
+                return -1;
+            heap->locked_size = heap_size;
+        }
+    }
+    heap = &heaps[0];
+
+    if (options->fit_scan_limit != 0)
+        fit_scan_limit = options->fit_scan_limit;
+
+    // 只有 vmem 后端能在堆尾之后保持储备.
+    if (options->reserve_size != 0)
+    {
+#if MM_BACKEND == MM_BACKEND_VMEM
+        if (vmem_reserve_start(options->reserve_size) < 0)
+            return -1;
+#else
+        return -1;
+#endif
+    }
+
+    return 0;
 }
 
-// 在 index 表示的链表，以及索引更小的链表中, 寻找第一个符合 aligned_size 的.
-// 如果剩余的 block size 小于 16, 直接分配这个块.
+// 分配 aligned_size 后剩下 remain_size, 这有多糟糕呢?
+// 0: 恰好放得下, 或者剩下的不够 split_threshold, 不用切分.
+// 1: 剩下的恰好是最近请求过的大小.
+// 2: 剩下的还能满足一次同样大小的请求.
+// 3: 剩下一小块, 多半用不上了.
+static inline unsigned int fit_score(unsigned int aligned_size,
+                                     unsigned int remain_size)
+{
+    if (remain_size < split_threshold)
+        return 0;
+    for (unsigned int i = 0; i < RECENT_SIZE_COUNT; i++)
+        if (recent_sizes[i] == remain_size)
+            return 1;
+    return remain_size >= aligned_size ? 2 : 3;
+}
+
+// 堆尾的空闲块. 堆尾是已分配的块时返回 NULL.
+static inline void *wilderness(void)
+{
+    return is_forward_allocated(heap->last_ptr) ? NULL
+                                                : get_forward(heap->last_ptr);
+}
+
+// 在 index 表示的链表，以及索引更小的链表中, 寻找符合 aligned_size 的块.
+// 最多比较 fit_scan_limit 个放得下的块, 取 fit_score 最小的, 一样时取小的.
+// 链表都找不到时, 在树中找最合适的. 不使用荒野块, 见 wilderness_fit.
+// 如果剩余的 block size 小于 split_threshold, 直接分配这个块.
 // 否则, 分配 aligned_size 大小的块, 将剩余的空间插入链表.
 // 找不到的话, 返回 NULL
 static void *find_fit_in_index_th_list(unsigned int aligned_size,
                                        unsigned int index)
 {
-    do
+    void *best = NULL;
+    unsigned int best_size = 0, best_score = 4, candidates = 0;
+    void *const wild = PRESERVE_WILDERNESS ? wilderness() : NULL;
+
+    // 不到 12 的大小类都在 12 号链表里, 看一遍就够了.
+    for (index = get_list(index); index >= 12 && index > TREE_INDEX; index--)
     {
-        for (void *begin_and_end = begins[index],
+        // 这个链表里肯定没有放得下的块.
+        if (heap->max_free_size[index] < aligned_size)
+            continue;
+
+        unsigned int max_size = 0;
+        for (void *begin_and_end = heap->begins[index],
                   *ptr = get_next(begin_and_end);
              ptr != begin_and_end; ptr = get_next(ptr))
         {
             unsigned int block_size = get_size(ptr);
-            if (block_size >= aligned_size)
+            if (block_size < aligned_size || ptr == wild)
+            {
+                if (block_size > max_size)
+                    max_size = block_size;
+                continue;
+            }
+
+            // 首次适配, 或者链表按大小排好了序, 第一个放得下的就是最合适的.
+            if (fit_scan_limit == 1 ||
+                (list_insert_policy[index] == MM_INSERT_SIZE && best == NULL))
+            {
+                best = ptr;
+                best_size = block_size;
+                goto found;
+            }
+
+            unsigned int score =
+                fit_score(aligned_size, block_size - aligned_size);
+            if (score < best_score ||
+                (score == best_score && block_size < best_size))
             {
-                delete_block(ptr);
-                return place(aligned_size, ptr, block_size);
+                best = ptr;
+                best_size = block_size;
+                best_score = score;
             }
+            if (block_size > max_size)
+                max_size = block_size;
+            if (best_score == 0 || ++candidates >= fit_scan_limit)
+                goto found;
         }
-    } while (--index > 11);
+
+        // 整个链表都看过了, 上界变成准确值.
+        heap->max_free_size[index] = max_size;
+    }
+
+found:
+    if (best != NULL)
+    {
+        delete_block(best);
+        return place_fit(aligned_size, best, best_size);
+    }
+
+    void *ptr = tree_find(aligned_size);
+    if (ptr != NULL && ptr == wild)
+        ptr = tree_find_after(wild, get_size(wild));
+    if (ptr != NULL)
+    {
+        unsigned int block_size = get_size(ptr);
+        delete_block(ptr);
+        return place_fit(aligned_size, ptr, block_size);
+    }
 
     return NULL;
 }
 
+// 链表和树中都找不到时, 才从荒野块中分配.
+// 找不到的话, 返回 NULL
+static void *wilderness_fit(unsigned int aligned_size)
+{
+    void *const wild = PRESERVE_WILDERNESS ? wilderness() : NULL;
+    if (wild == NULL || get_size(wild) < aligned_size)
+        return NULL;
+
+    unsigned int block_size = get_size(wild);
+    delete_block(wild);
+    return place(aligned_size, wild, block_size);
+}
+
+// 这次应该扩展多少呢?
+// 至少是 need_size, 按扩展策略向上取整; 不按比例扩展时至少是 min_size.
+static inline unsigned int extend_size_for(unsigned int need_size,
+                                           unsigned int min_size)
+{
+    size_t heap_size = (char *)heap->last_ptr - (char *)heap_base_ptr;
+    size_t size = need_size > min_size ? need_size : min_size;
+
+    if (EXTEND_GEOMETRIC)
+    {
+        // 很久没有扩展了, 增长已经慢下来.
+        unsigned int decay = heap->extend_clock / EXTEND_DECAY_COUNT;
+        heap->extend_level =
+            heap->extend_level > decay ? heap->extend_level - decay : 0;
+
+        size_t chunk = (size_t)EXTEND_MIN_SIZE << heap->extend_level;
+        if ((heap_size >> EXTEND_SHIFT) > chunk)
+            chunk =
+                (heap_size >> EXTEND_SHIFT) & ~(size_t)(EXTEND_MIN_SIZE - 1);
+        if (chunk > EXTEND_MAX_SIZE)
+            chunk = EXTEND_MAX_SIZE;
+        if (decay == 0 && heap->extend_level < EXTEND_MAX_LEVEL)
+            heap->extend_level++;
+        heap->extend_clock = 0;
+
+        if (chunk > size)
+            size = chunk;
+    }
+
+    // 使用大页时, 让堆尾落在大页的边界上.
+    // 基指针对齐到大页, 但堆尾不一定, 所以按扩展后的偏移量取整.
+    if (MM_HUGE_PAGES != MM_HUGE_PAGES_NONE)
+        size = ((heap_size + size + HUGE_PAGE_SIZE - 1) &
+                ~(size_t)(HUGE_PAGE_SIZE - 1)) -
+               heap_size;
+
+    return (unsigned int)size;
+}
+
 // 试图在堆尾构建一个 aligned_size 大小的空闲块.
 // 当然, 也可能构建出更大的.
 static void *extend_heap(unsigned int aligned_size)
 {
     // 如果堆尾不是空闲块了...
-    if (is_forward_allocated(heap_last_ptr))
+    if (is_forward_allocated(heap->last_ptr))
     {
         // extend 多少呢?
-        unsigned int extend_size =
-            aligned_size > EXTEND_SIZE ? aligned_size : EXTEND_SIZE;
-        void *old_heap_last_ptr = heap_last_ptr;
-        if (unlikely(mem_sbrk(extend_size) == (void *)-1))
+        unsigned int extend_size = extend_size_for(aligned_size, EXTEND_SIZE);
+        void *old_heap_last_ptr = heap->last_ptr;
+        if (unlikely(heap_sbrk(extend_size) == (void *)-1))
             return NULL;
-        heap_last_ptr = (char *)heap_last_ptr + extend_size;
+        heap->last_ptr = (char *)heap->last_ptr + extend_size;
         set_size(old_heap_last_ptr, extend_size);
         unset_allocated_flag(old_heap_last_ptr);
-        set_header(heap_last_ptr, 0 | ALLOCATED | FORWARD_FREE);
+        set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
         return place(aligned_size, old_heap_last_ptr, extend_size);
     }
     else
     {
         // 太棒了, 堆尾是空闲块.
-        void *forward = get_forward(heap_last_ptr);
-        // 先删掉.
-        delete_block(forward);
+        void *forward = get_forward(heap->last_ptr);
         unsigned int forward_size = get_size(forward);
-        unsigned int extend_size = aligned_size - forward_size;
-        extend_size = extend_size > EXTEND_SIZE ? extend_size : EXTEND_SIZE;
-        if (unlikely(mem_sbrk(extend_size) == (void *)-1))
+        unsigned int extend_size =
+            extend_size_for(aligned_size - forward_size, EXTEND_SIZE);
+        if (unlikely(heap_sbrk(extend_size) == (void *)-1))
             return NULL;
-        heap_last_ptr = (char *)heap_last_ptr + extend_size;
+        // 先删掉.
+        delete_block(forward);
+        heap->last_ptr = (char *)heap->last_ptr + extend_size;
         set_size(forward, forward_size + extend_size);
-        set_header(heap_last_ptr, 0 | ALLOCATED | FORWARD_FREE);
+        set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
         return place(aligned_size, forward, extend_size + forward_size);
     }
 }
 
-void *mm_malloc(size_t size)
+// 真正释放已分配的块 ptr, 并与相邻的空闲块合并.
+static void free_block(void *ptr)
 {
-    if (unlikely(size == 0))
-        return NULL;
+    void *back = get_back(ptr);
+    int forward_allocated = is_forward_allocated(ptr);
+    int back_allocated = is_allocated(back);
+    if (forward_allocated && back_allocated)
+    {
+        unsigned int size = get_size(ptr);
+        set_size(ptr, size);
+        unset_allocated_flag(ptr);
+        unset_forward_allocated_flag(back);
+        insert(ptr, size);
+        return;
+    }
+    if (!forward_allocated && back_allocated)
+    {
+        void *forward = get_forward(ptr);
+        delete_block(forward);
+        unsigned int size = get_size(forward) + get_size(ptr);
+        set_size(forward, size);
+        unset_forward_allocated_flag(back);
+        insert(forward, size);
+        return;
+    }
+    if (forward_allocated && !back_allocated)
+    {
+        delete_block(back);
+        unsigned int size = get_size(ptr) + get_size(back);
+        set_size(ptr, size);
+        unset_allocated_flag(ptr);
+        insert(ptr, size);
+        return;
+    }
+    if (!forward_allocated && !back_allocated)
+    {
+        void *forward = get_forward(ptr);
+        delete_block(forward);
+        delete_block(back);
+        unsigned int size =
+            get_size(forward) + get_size(ptr) + get_size(back);
+        set_size(forward, size);
+        insert(forward, size);
+        return;
+    }
+}
 
-    unsigned int aligned_size = align_size(size);
+// 把第 slot 个快速链表中的块全部真正释放.
+static void quick_flush(unsigned int slot)
+{
+    void *ptr;
+    while ((ptr = quick_pop(slot)) != NULL)
+        free_block(ptr);
+}
+
+// 清空所有快速链表. 如果真的释放了块, 返回 1.
+static int quick_flush_all(void)
+{
+    if (heap->quick_total == 0)
+        return 0;
+    for (unsigned int slot = QUICK_FIRST_SLOT; slot < QUICK_SLOT_COUNT;
+         slot++)
+        quick_flush(slot);
+    return 1;
+}
+
+// 找一个快速链表中的块, 它和前后的空闲块合并以后能放下 aligned_size,
+// 只把它真正释放. 其余的块留着给同样大小的请求.
+// 如果真的释放了块, 返回 1.
+static int quick_release_fit(unsigned int aligned_size)
+{
+    if (heap->quick_total == 0)
+        return 0;
+    for (unsigned int slot = QUICK_FIRST_SLOT; slot < QUICK_SLOT_COUNT;
+         slot++)
+    {
+        void *prev = NULL;
+        for (void *ptr = heap->quick_heads[slot]; ptr != NULL;)
+        {
+            unsigned int next = read_word(ptr);
+            unsigned int size = get_size(ptr);
+            if (!is_forward_allocated(ptr))
+                size += get_size(get_forward(ptr));
+            if (!is_allocated(get_back(ptr)))
+                size += get_size(get_back(ptr));
+
+            if (size >= aligned_size)
+            {
+                if (prev == NULL)
+                    heap->quick_heads[slot] =
+                        next == 0 ? NULL : (char *)heap_base_ptr + next;
+                else
+                    write_word(prev, next);
+                heap->quick_lengths[slot]--;
+                heap->quick_total--;
+                free_block(ptr);
+                return 1;
+            }
+
+            prev = ptr;
+            ptr = next == 0 ? NULL : (char *)heap_base_ptr + next;
+        }
+    }
+    return 0;
+}
+
+// 大小为 size 的块使用哪个快速链表. 不使用时返回 0.
+static inline unsigned int quick_slot(unsigned int size)
+{
+    if (size <= QUICK_MAX_SIZE)
+        return size >> 3;
+    for (unsigned int i = 0; i < HOT_BIN_COUNT; i++)
+        if (hot_sizes[i] == size)
+            return QUICK_COUNT + i;
+    return 0;
+}
+
+// 采样一次大小为 aligned_size 的请求. 它比某个热点更常见时, 取代那个热点.
+static void hot_observe(unsigned int aligned_size)
+{
+    if (aligned_size <= QUICK_MAX_SIZE || aligned_size > HOT_MAX_SIZE ||
+        ++hot_ticks % HOT_SAMPLE_PERIOD != 0)
+        return;
+
+    unsigned int key = aligned_size >> 3;
+    unsigned short *const a =
+        &hot_sketch[0][(key * 0x9e3779b1u) >> (32 - HOT_SKETCH_BITS)];
+    unsigned short *const b =
+        &hot_sketch[1][(key * 0x85ebca6bu) >> (32 - HOT_SKETCH_BITS)];
+    if (*a != 0xffff)
+        (*a)++;
+    if (*b != 0xffff)
+        (*b)++;
+    unsigned int estimate = *a < *b ? *a : *b;
+
+    unsigned int victim = 0;
+    for (unsigned int i = 0; i < HOT_BIN_COUNT; i++)
+    {
+        if (hot_sizes[i] == aligned_size)
+        {
+            hot_counts[i] = estimate;
+            victim = HOT_BIN_COUNT;
+            break;
+        }
+        if (hot_counts[i] < hot_counts[victim])
+            victim = i;
+    }
+
+    // 领先一点才取代, 免得两种大小来回换.
+    if (victim < HOT_BIN_COUNT && estimate > hot_counts[victim] + 1)
+    {
+        struct mm_heap *const current = heap;
+        for (heap = heaps; heap < heaps + REGION_COUNT; heap++)
+            quick_flush(QUICK_COUNT + victim);
+        for (heap = instances; heap != NULL; heap = heap->next_instance)
+            quick_flush(QUICK_COUNT + victim);
+        heap = current;
+        hot_sizes[victim] = aligned_size;
+        hot_counts[victim] = estimate;
+    }
+
+    if (++hot_samples >= HOT_DECAY_PERIOD)
+    {
+        for (unsigned int i = 0; i < 2; i++)
+            for (unsigned int j = 0; j < (1u << HOT_SKETCH_BITS); j++)
+                hot_sketch[i][j] >>= 1;
+        for (unsigned int i = 0; i < HOT_BIN_COUNT; i++)
+            hot_counts[i] >>= 1;
+        hot_samples = 0;
+    }
+}
+
+// 在当前区域中分配 aligned_size 大小的块, 不记录这次请求.
+static void *heap_alloc(unsigned int aligned_size)
+{
+    // 有恰好这么大的块吗?
+    unsigned int slot = quick_slot(aligned_size);
+    if (slot != 0)
+    {
+        void *ptr = quick_pop(slot);
+        if (ptr != NULL)
+            return ptr;
+    }
 
     unsigned int index = get_index(aligned_size);
 
@@ -430,58 +1904,413 @@ void *mm_malloc(size_t size)
     if (ptr != NULL)
         return ptr;
 
+    // 快速链表里的块和旁边的空闲块合并以后, 也许就够了.
+    // 只释放这样的一个块, 不动其余的块, 免得打散同样大小的请求.
+    if (quick_release_fit(aligned_size))
+    {
+        ptr = find_fit_in_index_th_list(aligned_size, index);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    // 只剩荒野块了.
+    ptr = wilderness_fit(aligned_size);
+    if (ptr != NULL)
+        return ptr;
+
+    // 要扩展堆了, 先把快速链表全部合并, 再找一次.
+    if (quick_flush_all())
+    {
+        ptr = find_fit_in_index_th_list(aligned_size, index);
+        if (ptr == NULL)
+            ptr = wilderness_fit(aligned_size);
+        if (ptr != NULL)
+            return ptr;
+    }
+
     // 如果找不到（悲
     // 那就要扩展堆了罢
     return extend_heap(aligned_size);
 }
 
-void mm_free(void *ptr)
+// 在当前区域中分配 aligned_size 大小的块.
+static void *heap_malloc(unsigned int aligned_size)
 {
-    if (likely(ptr != NULL))
+    heap->extend_clock++;
+    recent_sizes[recent_cursor++ % RECENT_SIZE_COUNT] = aligned_size;
+    split_observe(aligned_size);
+    hot_observe(aligned_size);
+    return heap_alloc(aligned_size);
+}
+
+/**
+ * 托儿所的 chunk 的 payload 中, 第一个字是活着的对象数,
+ * 第二个字是下一个对象的起点相对 chunk 的偏移量. 之后是一个个对象:
+ *
+ * +-----------------+------------------------+---------------------------+
+ * | chunk offset(4) | size | NURSERY | ALLOC | payload (size - 12 bytes) |
+ * +-----------------+------------------------+---------------------------+
+ *                                            ^ ptr
+ *
+ * size 包括前面的 8 字节, 对齐到 8. chunk offset 是 chunk 相对堆基指针的偏移量.
+ */
+
+// 对象 ptr 所在的 chunk.
+static inline void *nursery_chunk_of(void *ptr)
+{
+    return (char *)heap_base_ptr + read_word((char *)ptr - 2 * WORD_SIZE);
+}
+
+// 在当前区域的托儿所中分配 aligned_size 大小的对象. 失败时返回 NULL.
+static void *nursery_malloc(unsigned int aligned_size)
+{
+    unsigned int object_size = aligned_size + 2 * WORD_SIZE;
+    void *chunk = heap->nursery;
+
+    if (chunk == NULL ||
+        read_word((char *)chunk + WORD_SIZE) + object_size >
+            get_size(chunk) - WORD_SIZE)
     {
-        void *back = get_back(ptr);
-        int forward_allocated = is_forward_allocated(ptr);
-        int back_allocated = is_allocated(back);
-        if (forward_allocated && back_allocated)
+        // 旧的 chunk 留给还活着的对象, 它们都死了以后再释放.
+        // 一个都没有活着的话, 就直接重用.
+        if (chunk == NULL || read_word(chunk) != 0)
         {
-            unsigned int size = get_size(ptr);
-            set_size(ptr, size);
-            unset_allocated_flag(ptr);
-            unset_forward_allocated_flag(back);
-            insert(ptr, size);
-            return;
-        }
-        if (!forward_allocated && back_allocated)
-        {
-            void *forward = get_forward(ptr);
-            delete_block(forward);
-            unsigned int size = get_size(forward) + get_size(ptr);
-            set_size(forward, size);
-            unset_forward_allocated_flag(back);
-            insert(forward, size);
-            return;
-        }
-        if (forward_allocated && !back_allocated)
-        {
-            delete_block(back);
-            unsigned int size = get_size(ptr) + get_size(back);
-            set_size(ptr, size);
-            unset_allocated_flag(ptr);
-            insert(ptr, size);
-            return;
-        }
-        if (!forward_allocated && !back_allocated)
-        {
-            void *forward = get_forward(ptr);
-            delete_block(forward);
-            delete_block(back);
-            unsigned int size =
-                get_size(forward) + get_size(ptr) + get_size(back);
-            set_size(forward, size);
-            insert(forward, size);
-            return;
+            // chunk 不是调用者的请求, 不计入大小的统计.
+            chunk = heap_alloc(NURSERY_CHUNK_SIZE);
+            if (chunk == NULL)
+                return NULL;
+            heap->nursery = chunk;
         }
+        write_word(chunk, 0);
+        write_word((char *)chunk + WORD_SIZE, 2 * WORD_SIZE);
+    }
+
+    unsigned int offset = read_word((char *)chunk + WORD_SIZE);
+    void *ptr = (char *)chunk + offset + 2 * WORD_SIZE;
+    write_word((char *)ptr - 2 * WORD_SIZE,
+               (char *)chunk - (char *)heap_base_ptr);
+    set_header(ptr, object_size | NURSERY_OBJECT | ALLOCATED);
+    write_word((char *)chunk + WORD_SIZE, offset + object_size);
+    write_word(chunk, read_word(chunk) + 1);
+    return ptr;
+}
+
+// 释放托儿所中的对象 ptr.
+static void nursery_free(void *ptr)
+{
+    void *chunk = nursery_chunk_of(ptr);
+    unsigned int live = read_word(chunk) - 1;
+    write_word(chunk, live);
+    if (live != 0)
+        return;
+
+    // 当前的 chunk 从头开始重用, 其余的整个释放.
+    if (chunk == heap->nursery)
+        write_word((char *)chunk + WORD_SIZE, 2 * WORD_SIZE);
+    else
+        free_block(chunk);
+}
+
+void *mm_malloc(size_t size)
+{
+    if (unlikely(size == 0))
+        return NULL;
+
+    unsigned int aligned_size = align_size(size);
+    heap = heap_for(aligned_size);
+
+    if (NURSERY && aligned_size <= NURSERY_MAX_SIZE)
+    {
+        void *ptr = nursery_malloc(aligned_size);
+        if (ptr != NULL)
+            return ptr;
     }
+
+    return heap_malloc(aligned_size);
+}
+
+// 按对象的寿命分配. hint 是 MM_SHORT_LIVED, MM_LONG_LIVED 或 MM_PERMANENT;
+// 短命的对象和 mm_malloc 一样分配, 其余的各自在自己的区域中分配.
+void *mm_malloc_hint(size_t size, int hint)
+{
+    if (unlikely(size == 0))
+        return NULL;
+
+#if LIFETIME_REGIONS
+    if (hint & (MM_PERMANENT | MM_LONG_LIVED))
+    {
+        heap = &heaps[hint & MM_PERMANENT ? REGION_PERMANENT
+                                          : REGION_LONG_LIVED];
+        return heap_malloc(align_size(size));
+    }
+#else
+    (void)hint;
+#endif
+    return mm_malloc(size);
+}
+
+static inline void grow_forget(void *ptr);
+static inline void reserve_forget(void *ptr);
+
+// 释放当前区域中的块 ptr.
+static void heap_free(void *ptr)
+{
+    if (NURSERY && is_nursery_object(ptr))
+    {
+        nursery_free(ptr);
+        return;
+    }
+    grow_forget(ptr);
+    reserve_forget(ptr);
+    unsigned int slot = quick_slot(get_size(ptr));
+    if (slot != 0)
+    {
+        // 快速链表满了, 先把里面的块合并掉.
+        if (heap->quick_lengths[slot] >= QUICK_LIST_LENGTH)
+            quick_flush(slot);
+        quick_push(ptr, slot);
+        return;
+    }
+    free_block(ptr);
+}
+
+void mm_free(void *ptr)
+{
+    if (likely(ptr != NULL))
+    {
+        heap = heap_of(ptr);
+        heap_free(ptr);
+    }
+}
+
+// ptr 在增长次数表中的位置.
+static inline unsigned int grow_slot(void *ptr)
+{
+    return ((unsigned int)((uintptr_t)ptr >> 3) * 0x9e3779b1u) >>
+           (32 - GROW_TABLE_BITS);
+}
+
+// 块 ptr 被 mm_realloc 变大过几次.
+static inline unsigned int grow_count(void *ptr)
+{
+    unsigned int slot = grow_slot(ptr);
+    return grow_keys[slot] == (unsigned int)((uintptr_t)ptr >> 3)
+               ? grow_counts[slot]
+               : 0;
+}
+
+// 记下块 ptr 被变大过 count 次.
+static inline void grow_record(void *ptr, unsigned int count)
+{
+    unsigned int slot = grow_slot(ptr);
+    grow_keys[slot] = (unsigned int)((uintptr_t)ptr >> 3);
+    grow_counts[slot] = count > 255 ? 255 : count;
+}
+
+// 块 ptr 释放了, 清掉它的增长次数, 之后在这里分配的块从 0 开始数.
+static inline void grow_forget(void *ptr)
+{
+    unsigned int slot = grow_slot(ptr);
+    if (grow_keys[slot] == (unsigned int)((uintptr_t)ptr >> 3))
+        grow_keys[slot] = 0;
+}
+
+// 堆尾是不是还被另一个一直在变大的块占着?
+// 两个块轮流搬到堆尾只会来回复制, 所以这时不搬.
+// tail_grower 可能已经不是块的起点了, 读到的 header 不可靠, 但只影响放在哪里.
+static inline int tail_taken(void *ptr)
+{
+    void *const grower = heap->tail_grower;
+    if (grower == NULL || grower == ptr || grower >= heap->last_ptr)
+        return 0;
+    void *const back = get_back(grower);
+    return is_allocated(grower) &&
+           (back == heap->last_ptr || back == wilderness());
+}
+
+// ptr 在预留表中的位置.
+static inline unsigned int reserve_slot(void *ptr)
+{
+    return ((unsigned int)((uintptr_t)ptr >> 3) * 0x85ebca6bu) >>
+           (32 - RESERVE_TABLE_BITS);
+}
+
+// 块 ptr 是不是用 mm_reserve 预留过空间?
+// 块的大小变了, 说明它被挪动过或者切分过, 记录作废.
+static inline int is_reserved(void *ptr)
+{
+    unsigned int slot = reserve_slot(ptr);
+    return reserve_keys[slot] == (unsigned int)((uintptr_t)ptr >> 3) &&
+           reserve_sizes[slot] == get_size(ptr);
+}
+
+// 记下块 ptr 现在的大小是预留的.
+static inline void reserve_record(void *ptr)
+{
+    unsigned int slot = reserve_slot(ptr);
+    reserve_keys[slot] = (unsigned int)((uintptr_t)ptr >> 3);
+    reserve_sizes[slot] = get_size(ptr);
+}
+
+// 块 ptr 释放了, 清掉它的预留记录, 之后在这里分配的块不会继承它.
+static inline void reserve_forget(void *ptr)
+{
+    unsigned int slot = reserve_slot(ptr);
+    if (reserve_keys[slot] == (unsigned int)((uintptr_t)ptr >> 3))
+        reserve_keys[slot] = 0;
+}
+
+// 在当前区域的堆尾分配 aligned_size 大小的块.
+static void *tail_malloc(unsigned int aligned_size)
+{
+    void *const wild = wilderness();
+    if (wild != NULL && get_size(wild) >= aligned_size)
+    {
+        unsigned int block_size = get_size(wild);
+        delete_block(wild);
+        return place(aligned_size, wild, block_size);
+    }
+    return extend_heap(aligned_size);
+}
+
+// 在已分配的块 hint 附近分配 size 字节.
+// 先看 hint 前面的空闲块, 再沿着 header 向后看至多 NEAR_SCAN_LIMIT 个块,
+// 和 hint 在同一页中的优先. 都放不下时, 在 hint 所在的区域中正常分配.
+void *mm_malloc_near(void *hint, size_t size)
+{
+    if (hint == NULL || (NURSERY && is_nursery_object(hint)))
+        return mm_malloc(size);
+    if (unlikely(size == 0))
+        return NULL;
+
+    heap = heap_of(hint);
+    unsigned int aligned_size = align_size(size);
+    uintptr_t page = (uintptr_t)hint & ~(uintptr_t)(PAGE_SIZE - 1);
+    void *const wild = PRESERVE_WILDERNESS ? wilderness() : NULL;
+    void *best = NULL;
+
+    // 前块是空闲的, 它紧挨着 hint.
+    if (!is_forward_allocated(hint))
+    {
+        void *forward = get_forward(hint);
+        if (get_size(forward) >= aligned_size && forward != wild)
+            best = forward;
+    }
+
+    void *ptr = get_back(hint);
+    for (unsigned int i = 0;
+         i < NEAR_SCAN_LIMIT && ptr < heap->last_ptr &&
+         (best == NULL ||
+          ((uintptr_t)best & ~(uintptr_t)(PAGE_SIZE - 1)) != page);
+         i++, ptr = get_back(ptr))
+    {
+        if (is_allocated(ptr) || get_size(ptr) < aligned_size || ptr == wild)
+            continue;
+        if (best == NULL ||
+            ((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1)) == page)
+            best = ptr;
+    }
+
+    // 附近没有, 就像 mm_malloc 一样分配. hint 在默认区域中时,
+    // 按大小选区域, 小块不会跟着 hint 跑到大块的区域里.
+    if (best == NULL)
+    {
+        if (heap < &heaps[REGION_DEFAULT_COUNT])
+            heap = heap_for(aligned_size);
+        return heap_malloc(aligned_size);
+    }
+
+    // 从靠近 hint 的一端切.
+    unsigned int block_size = get_size(best);
+    delete_block(best);
+    if ((char *)best < (char *)hint)
+        return place_high(aligned_size, best, block_size);
+    return place(aligned_size, best, block_size);
+}
+
+// 把已分配的块 ptr 从 old_block_size 原地扩大到 new_block_size, 占用空闲的后块.
+// 成功时返回 0; 后块不是空闲的, 或者不够大时返回 -1.
+static int expand_into_back(void *ptr, unsigned int old_block_size,
+                            unsigned int new_block_size)
+{
+    unsigned int extend_size = new_block_size - old_block_size;
+    void *back = get_back(ptr);
+    unsigned int back_size = get_size(back);
+
+    if (is_allocated(back) || extend_size > back_size)
+        return -1;
+
+    unsigned int new_back_size = back_size - extend_size;
+    delete_block(back);
+    if (new_back_size >= split_threshold)
+    {
+        void *new_back = (char *)back + extend_size;
+
+        set_size(new_back, new_back_size);
+        unset_allocated_flag(new_back);
+        set_forward_allocated_flag(new_back);
+
+        insert(new_back, new_back_size);
+
+        set_size_only_header(ptr, new_block_size);
+    }
+    else
+    {
+        set_size_only_header(ptr, old_block_size + back_size);
+        set_forward_allocated_flag(get_back(ptr));
+    }
+    return 0;
+}
+
+// 与 expand_into_back 相同, 但是 ptr 恰好在堆尾, 或者后块是堆尾的空闲块,
+// 不够的部分扩展堆得到.
+// 成功时返回 0; ptr 不在堆尾, 或者扩展堆失败时返回 -1.
+static int expand_at_tail(void *ptr, unsigned int old_block_size,
+                          unsigned int new_block_size)
+{
+    unsigned int extend_size = new_block_size - old_block_size;
+    void *back = get_back(ptr);
+    int back_is_tail = back == heap->last_ptr;
+    int back_is_free_tail = !back_is_tail && !is_allocated(back) &&
+                            get_back(back) == heap->last_ptr;
+
+    if (!back_is_tail && !back_is_free_tail)
+        return -1;
+
+    // 后块够大的话, expand_into_back 就能做到.
+    unsigned int free_size = back_is_free_tail ? get_size(back) : 0;
+    if (free_size >= extend_size)
+        return expand_into_back(ptr, old_block_size, new_block_size);
+
+    unsigned int grow_size = extend_size_for(extend_size - free_size, 0);
+
+    if (unlikely(heap_sbrk(grow_size) == (void *)-1))
+        return -1;
+
+    if (back_is_free_tail)
+        delete_block(back);
+
+    heap->last_ptr = (char *)heap->last_ptr + grow_size;
+
+    // 多扩展出来的部分留在块后, 作为堆尾的空闲块.
+    unsigned int remain_size = free_size + grow_size - extend_size;
+    if (remain_size >= split_threshold)
+    {
+        set_size_only_header(ptr, new_block_size);
+
+        void *new_back = get_back(ptr);
+        set_header(new_back, 0 | FREE | FORWARD_ALLOCATED);
+        set_size(new_back, remain_size);
+        insert(new_back, remain_size);
+
+        set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
+    }
+    else
+    {
+        set_size_only_header(ptr, new_block_size + remain_size);
+        set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_ALLOCATED);
+    }
+    return 0;
 }
 
 void *mm_realloc(void *old_ptr, size_t size)
@@ -497,90 +2326,430 @@ void *mm_realloc(void *old_ptr, size_t size)
         return NULL;
     }
 
+    heap = heap_of(old_ptr);
+
+    // 托儿所中的对象不能原地变大, 放不下就搬家.
+    if (NURSERY && is_nursery_object(old_ptr))
+    {
+        unsigned int payload_size = get_payload_size(old_ptr);
+        if (size <= payload_size)
+            return old_ptr;
+
+        void *newptr = mm_malloc(size);
+        if (newptr != NULL)
+        {
+            memcpy(newptr, old_ptr, payload_size);
+            mm_free(old_ptr);
+        }
+        return newptr;
+    }
+
     // 接下来分情况讨论.
     // 先计算以下旧块的大小和新块的大小.
     unsigned int old_block_size = get_size((void *)old_ptr),
                  new_block_size = align_size(size);
 
     // 如果旧块比新块大... 那直接缩水旧块好了.
+    // 它不再是一直在变大的块了. mm_reserve 预留的空间不还回去.
     if (new_block_size <= old_block_size)
+    {
+        if (grow_count(old_ptr) != 0)
+            grow_record(old_ptr, 0);
+        if (is_reserved(old_ptr))
+            return old_ptr;
         return shrink(new_block_size, old_ptr, old_block_size);
+    }
 
     // 假如旧块比新块小, 考虑以下情况.
-    // 首先计算一下需要扩展多少空间.
-    unsigned int extend_size = new_block_size - old_block_size;
+    heap->extend_clock++;
+    unsigned int grows = grow_count(old_ptr) + 1;
+
+    // 后块有足够空间吗?
+    if (expand_into_back(old_ptr, old_block_size, new_block_size) == 0)
+    {
+        grow_record(old_ptr, grows);
+        return old_ptr;
+    }
 
-    // 看看后块 (
     void *back = get_back(old_ptr);
     unsigned int back_size = get_size(back);
 
-    // 如果后块有足够空间.
-    if (!is_allocated(back) && extend_size <= back_size)
+    // 前块是空闲的, 加上它 (必要时再加上后块) 就够了.
+    // 把数据向前挪, 不用重新找块, 堆也不用变大.
+    if (!is_forward_allocated(old_ptr))
     {
-        unsigned int new_back_size = back_size - extend_size;
-        if (new_back_size >= 16)
+        void *forward = get_forward(old_ptr);
+        int back_free = !is_allocated(back);
+        unsigned int total_size =
+            get_size(forward) + old_block_size + (back_free ? back_size : 0);
+
+        if (total_size >= new_block_size)
         {
-            delete_block(back);
+            delete_block(forward);
+            if (back_free)
+                delete_block(back);
 
-            void *new_back = (char *)back + extend_size;
+            memmove(forward, old_ptr, old_block_size - WORD_SIZE);
 
-            set_size(new_back, new_back_size);
-            unset_allocated_flag(new_back);
-            set_forward_allocated_flag(new_back);
+            unsigned int remain_size = total_size - new_block_size;
+            if (remain_size >= split_threshold)
+            {
+                set_size_only_header(forward, new_block_size);
+                set_allocated_flag(forward);
+
+                void *new_back = get_back(forward);
+                set_header(new_back, 0 | FREE | FORWARD_ALLOCATED);
+                set_size(new_back, remain_size);
+                unset_forward_allocated_flag(get_back(new_back));
+                insert(new_back, remain_size);
+            }
+            else
+            {
+                set_size_only_header(forward, total_size);
+                set_allocated_flag(forward);
+                set_forward_allocated_flag(get_back(forward));
+            }
+            grow_record(forward, grows);
+            return forward;
+        }
+    }
 
-            insert(new_back, new_back_size);
+    // 太棒了, 这个块恰好在堆尾, 或者后块是堆尾的空闲块 (但不够大).
+    if (expand_at_tail(old_ptr, old_block_size, new_block_size) == 0)
+    {
+        grow_record(old_ptr, grows);
+        return old_ptr;
+    }
 
-            set_size_only_header(old_ptr, new_block_size);
-            return old_ptr;
-        }
-        else
-        {
-            delete_block(back);
-            set_size_only_header(old_ptr, old_block_size + back_size);
-            set_forward_allocated_flag(get_back(old_ptr));
-            return old_ptr;
-        }
+    // 按寿命分配的块搬家以后还留在原来的区域里.
+    // 一直在变大的块搬到堆尾, 以后就能原地增长了.
+    void *newptr;
+    if (heap < &heaps[REGION_DEFAULT_COUNT])
+        heap = heap_for(new_block_size);
+    if (grows >= GROW_TAIL_COUNT && !tail_taken(old_ptr))
+    {
+        newptr = tail_malloc(new_block_size);
+        heap->tail_grower = newptr;
     }
+    else if (heap >= &heaps[REGION_DEFAULT_COUNT])
+        newptr = heap_malloc(new_block_size);
+    else
+        newptr = mm_malloc(size);
 
-    // 太棒了, 这个块恰好在堆尾.
-    if (back == heap_last_ptr)
+    // 分配失败时旧块原样留给调用者.
+    if (newptr != NULL)
     {
-        if (unlikely(mem_sbrk(extend_size) == (void *)-1))
-            return NULL;
+        grow_record(newptr, grows);
+        copy_payload(newptr, old_ptr, get_payload_size(old_ptr));
+        mm_free(old_ptr);
+    }
+
+    return newptr;
+}
+
+// 把块 ptr 原地扩大到至少能放下 new_size 字节. 绝不搬家.
+// 成功 (包括本来就够大) 时返回 0; 后面没有足够的空间时返回 -1.
+int mm_try_expand(void *ptr, size_t new_size)
+{
+    if (ptr == NULL || new_size >= HEAP_MAX_SIZE - PAGE_SIZE)
+        return -1;
 
-        heap_last_ptr = (char *)heap_last_ptr + extend_size;
+    heap = heap_of(ptr);
+    if (NURSERY && is_nursery_object(ptr))
+        return new_size <= get_payload_size(ptr) ? 0 : -1;
 
-        set_size_only_header(old_ptr, new_block_size);
+    unsigned int old_block_size = get_size(ptr),
+                 new_block_size = align_size(new_size);
+    if (new_block_size <= old_block_size)
+        return 0;
+
+    // 后块可能挂在快速链表上, 合并以后再试一次.
+    int reserved = is_reserved(ptr);
+    if (expand_into_back(ptr, old_block_size, new_block_size) < 0 &&
+        expand_at_tail(ptr, old_block_size, new_block_size) < 0 &&
+        (!quick_flush_all() ||
+         (expand_into_back(ptr, old_block_size, new_block_size) < 0 &&
+          expand_at_tail(ptr, old_block_size, new_block_size) < 0)))
+        return -1;
 
-        set_header(heap_last_ptr, 0 | ALLOCATED | FORWARD_ALLOCATED);
-        return old_ptr;
+    if (reserved)
+        reserve_record(ptr);
+    return 0;
+}
+
+// 为块 ptr 预留到 capacity 字节: 现在就把后面的空间并进来,
+// 之后 mm_realloc 缩小它时也不归还, 直到增长到这么大都不需要搬家.
+// 成功时返回 0; 后面没有足够的空间时返回 -1, 块不变.
+int mm_reserve(void *ptr, size_t capacity)
+{
+    if (mm_try_expand(ptr, capacity) < 0)
+        return -1;
+    if (!(NURSERY && is_nursery_object(ptr)))
+        reserve_record(ptr);
+    return 0;
+}
+
+// 块 ptr 实际能用的字节数, 包括对齐和没有切分出去的部分. ptr 为 NULL 时返回 0.
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    return get_payload_size(ptr);
+}
+
+// 与 mm_malloc 相同, 但是把块实际能用的字节数写到 *actual.
+// actual 可以是 NULL. 失败时 *actual 为 0.
+void *mm_malloc_at_least(size_t size, size_t *actual)
+{
+    void *const ptr = mm_malloc(size);
+    if (actual != NULL)
+        *actual = mm_usable_size(ptr);
+    return ptr;
+}
+
+// 创建一个独立的堆. 它有自己的地址空间, 链表和堆尾,
+// 与默认的堆以及其他独立的堆互不影响, 可以用 mm_heap_destroy 整个丢弃.
+// 需要先调用 mm_init, 并且只有 vmem 后端支持; 失败时返回 NULL.
+mm_heap_t *mm_heap_create(void)
+{
+#if MM_BACKEND == MM_BACKEND_VMEM
+    if (list_min_block_size == NULL)
+        return NULL;
+
+    struct mm_heap *h = mmap(NULL, sizeof(struct mm_heap),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED)
+        return NULL;
+
+    h->base = h->brk = h->commit = vmem_reserve(VMEM_RESERVE_SIZE);
+    if (h->base == NULL)
+    {
+        munmap(h, sizeof(struct mm_heap));
+        return NULL;
     }
 
-    void *newptr = mm_malloc(size);
+    struct mm_heap *const current = heap;
+    heap = h;
+    int failed = heap_init() < 0;
+    heap = current;
+    if (failed)
+    {
+        munmap(h->base, VMEM_RESERVE_SIZE);
+        munmap(h, sizeof(struct mm_heap));
+        return NULL;
+    }
 
-    if (newptr != NULL)
-        memcpy(newptr, old_ptr, get_size((void *)old_ptr));
-    mm_free(old_ptr);
+    h->next_instance = instances;
+    instances = h;
+    return h;
+#else
+    return NULL;
+#endif
+}
 
-    return newptr;
+// 在堆 h 中分配 size 字节. h 为 NULL 时与 mm_malloc 相同.
+void *mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+    if (h == NULL)
+        return mm_malloc(size);
+    if (unlikely(size == 0))
+        return NULL;
+
+    heap = h;
+    return heap_malloc(align_size(size));
+}
+
+// 释放堆 h 中的块 ptr. h 为 NULL 时与 mm_free 相同.
+void mm_heap_free(mm_heap_t *h, void *ptr)
+{
+    if (h == NULL)
+    {
+        mm_free(ptr);
+        return;
+    }
+    if (likely(ptr != NULL))
+    {
+        heap = h;
+        heap_free(ptr);
+    }
+}
+
+// 丢弃堆 h 和其中所有的块, 把内存全部还给系统.
+void mm_heap_destroy(mm_heap_t *h)
+{
+#if MM_BACKEND == MM_BACKEND_VMEM
+    if (h == NULL)
+        return;
+
+    for (struct mm_heap **p = &instances; *p != NULL; p = &(*p)->next_instance)
+        if (*p == h)
+        {
+            *p = h->next_instance;
+            break;
+        }
+
+    if (heap == h)
+        heap = &heaps[0];
+    munmap(h->base, VMEM_RESERVE_SIZE);
+    munmap(h, sizeof(struct mm_heap));
+#else
+    (void)h;
+#endif
 }
 
 void *mm_calloc(size_t nmemb, size_t size)
 {
     void *const ptr = mm_malloc(nmemb * size);
     if (likely(ptr != NULL))
-        memset(ptr, 0, nmemb * size);
+        zero_payload(ptr, nmemb * size);
     return ptr;
 }
 
-void mm_checkheap(int lineno)
+// 设置大小为 size 的空闲块所在的大小类的插入策略.
+// 已经在链表中的块不会重新排序, 所以随时都可以切换.
+// 成功时返回 0; 这个大小类由树管理, 或者 policy 无效时返回 -1.
+int mm_set_insert_policy(size_t size, int policy)
+{
+    if (size < 16 || size >= HEAP_MAX_SIZE)
+        return -1;
+
+    unsigned int index = get_index(size);
+    if (index <= TREE_INDEX ||
+        (policy != MM_INSERT_FIFO && policy != MM_INSERT_ADDRESS &&
+         policy != MM_INSERT_SIZE))
+        return -1;
+
+    list_insert_policy[get_list(index)] = policy;
+    return 0;
+}
+
+// 把当前区域堆尾空闲块中超出 pad 的部分还给系统.
+// 真的归还了内存时返回 1, 否则返回 0.
+static int heap_trim(size_t pad)
 {
-    for (void *iterator = (char *)heap_base_ptr + 136; iterator < heap_last_ptr;
+    // 快速链表里的块可能挡在堆尾.
+    quick_flush_all();
+
+    // 堆尾不是空闲块, 没什么可以还的.
+    if (is_forward_allocated(heap->last_ptr))
+        return 0;
+
+    void *forward = get_forward(heap->last_ptr);
+    unsigned int forward_size = get_size(forward);
+    size_t keep_size = pad < 16 ? 16 : (pad + 7) & ~(size_t)7;
+
+    if (forward_size <= keep_size)
+        return 0;
+
+    // 按页归还. mm_init_ex 锁住的部分不归还.
+    size_t heap_size = (char *)heap->last_ptr - (char *)heap_base_ptr;
+    size_t release_size = forward_size - keep_size;
+    if (heap_size - release_size < heap->locked_size)
+        release_size = heap_size > heap->locked_size
+                           ? heap_size - heap->locked_size
+                           : 0;
+    release_size &= ~(size_t)(PAGE_SIZE - 1);
+    if (release_size == 0)
+        return 0;
+
+    // memlib 不接受负的增量, 这时什么也不做.
+    if (heap_sbrk(-(intptr_t)release_size) == (void *)-1)
+        return 0;
+
+    delete_block(forward);
+    heap->last_ptr = (char *)heap->last_ptr - release_size;
+    set_size(forward, forward_size - release_size);
+    insert(forward, forward_size - release_size);
+    set_header(heap->last_ptr, 0 | ALLOCATED | FORWARD_FREE);
+
+    // 堆尾长期用不上, 说明增长已经停下来了.
+    heap->extend_level = 0;
+    heap->extend_clock = 0;
+    return 1;
+}
+
+// 把每个区域堆尾空闲块中超出 pad 的部分还给系统.
+// 真的归还了内存时返回 1, 否则返回 0.
+int mm_trim(size_t pad)
+{
+    int trimmed = 0;
+    for (heap = heaps; heap < heaps + REGION_COUNT; heap++)
+        trimmed |= heap_trim(pad);
+    heap = &heaps[0];
+    return trimmed;
+}
+
+// 检查子树 tree: 键都在 (low, high) 之间, 并且满足堆性质.
+// 返回子树中块的数量.
+static unsigned int check_tree(int lineno, void *tree, void *low, void *high)
+{
+    if (tree == NULL)
+        return 0;
+
+    if (is_allocated(tree) || get_index(get_size(tree)) > TREE_INDEX)
+        printf("Line %d: The Block %p in the tree is wrong.\n", lineno, tree);
+    if ((low != NULL && tree_less(tree, get_size(tree), low)) ||
+        (high != NULL && !tree_less(tree, get_size(tree), high)))
+        printf("Line %d: The Block %p in the tree is out of order.\n", lineno,
+               tree);
+
+    void *left = get_left(tree), *right = get_right(tree);
+    if ((left != NULL && tree_priority(left) > tree_priority(tree)) ||
+        (right != NULL && tree_priority(right) > tree_priority(tree)))
+        printf("Line %d: The Block %p in the tree breaks the heap order.\n",
+               lineno, tree);
+
+    return 1 + check_tree(lineno, left, low, tree) +
+           check_tree(lineno, right, tree, high);
+}
+
+// 检查当前区域.
+static void heap_check(int lineno)
+{
+    check_tree(lineno, heap->tree_root, NULL, NULL);
+
+    if (heap->nursery != NULL &&
+        (!is_allocated(heap->nursery) ||
+         read_word((char *)heap->nursery + WORD_SIZE) >
+             get_size(heap->nursery) - WORD_SIZE))
+    {
+        printf("Line %d: The nursery chunk %p is wrong.\n", lineno,
+               heap->nursery);
+    }
+
+    for (unsigned int slot = QUICK_FIRST_SLOT; slot < QUICK_SLOT_COUNT;
+         slot++)
+    {
+        unsigned int size =
+            slot < QUICK_COUNT ? slot << 3 : hot_sizes[slot - QUICK_COUNT];
+        unsigned int length = 0;
+        for (void *iterator = heap->quick_heads[slot]; iterator != NULL;
+             iterator = read_word(iterator) == 0
+                            ? NULL
+                            : (char *)heap_base_ptr + read_word(iterator))
+        {
+            length++;
+            if (!is_allocated(iterator) || get_size(iterator) != size)
+            {
+                printf("Line %d: The Block %p in quick list %u is wrong.\n",
+                       lineno, iterator, size);
+            }
+        }
+        if (length != heap->quick_lengths[slot])
+        {
+            printf("Line %d: Quick list %u has %u blocks, but %u is "
+                   "recorded.\n",
+                   lineno, size, length, heap->quick_lengths[slot]);
+        }
+    }
+
+    for (void *iterator = (char *)heap_base_ptr + 136; iterator < heap->last_ptr;
          iterator = get_back(iterator))
     {
         if (is_allocated(iterator) ^ is_forward_allocated(get_back(iterator)))
         {
-            printf("Heap tail is %p\n", heap_last_ptr);
+            printf("Heap tail is %p\n", heap->last_ptr);
             printf("Line %d: The Block %p 's ALLOCATED is wrong.\n", lineno,
                    (void *)iterator);
 
@@ -592,7 +2761,7 @@ void mm_checkheap(int lineno)
 
         if (!is_allocated(iterator) && !is_allocated(get_back(iterator)))
         {
-            printf("Heap tail is %p\n", heap_last_ptr);
+            printf("Heap tail is %p\n", heap->last_ptr);
             printf("Line %d: The Block %p and its back are both free.\n",
                    lineno, (void *)iterator);
         }
@@ -601,7 +2770,7 @@ void mm_checkheap(int lineno)
             get_size(iterator) != read_word((char *)iterator +
                                             get_size(iterator) - 2 * WORD_SIZE))
         {
-            printf("Heap tail is %p\n", heap_last_ptr);
+            printf("Heap tail is %p\n", heap->last_ptr);
             printf("Line %d: Size of the Block %p in header is different from "
                    "its footer.\n",
                    lineno, (void *)iterator);
@@ -609,13 +2778,13 @@ void mm_checkheap(int lineno)
 
         for (size_t i = 12; i < 28; i++)
         {
-            for (void *const end = begins[i], *iterator = get_next(end);
+            for (void *const end = heap->begins[i], *iterator = get_next(end);
                  iterator != end; iterator = get_next(iterator))
             {
                 if (get_size(iterator) < list_min_block_size[i] ||
                     get_size(iterator) >= list_max_block_size[i])
                 {
-                    printf("Heap tail is %p\n", heap_last_ptr);
+                    printf("Heap tail is %p\n", heap->last_ptr);
                     printf(
                         "Line %d: The Block %p in List %lu has wrong size.\n",
                         lineno, (void *)iterator, i);
@@ -628,9 +2797,16 @@ void mm_checkheap(int lineno)
                         get_size(iterator));
                 }
 
+                if (get_size(iterator) > heap->max_free_size[i])
+                {
+                    printf("Line %d: The Block %p in List %lu is larger than "
+                           "the recorded maximum %u.\n",
+                           lineno, (void *)iterator, i, heap->max_free_size[i]);
+                }
+
                 if (get_prev(get_next(iterator)) != iterator)
                 {
-                    printf("Heap tail is %p\n", heap_last_ptr);
+                    printf("Heap tail is %p\n", heap->last_ptr);
                     printf(
                         "Line %d: The pointer between Block %p and its back is "
                         "wrong.\n",
@@ -640,3 +2816,12 @@ void mm_checkheap(int lineno)
         }
     }
 }
+
+void mm_checkheap(int lineno)
+{
+    for (heap = heaps; heap < heaps + REGION_COUNT; heap++)
+        heap_check(lineno);
+    for (heap = instances; heap != NULL; heap = heap->next_instance)
+        heap_check(lineno);
+    heap = &heaps[0];
+}
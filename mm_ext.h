@@ -0,0 +1,97 @@
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+
+/**
+ * mm.c 在 mm.h 之外提供的扩展接口.
+ */
+
+// 把堆尾空闲块中超出 pad 字节的部分还给系统.
+// 真的归还了内存时返回 1, 否则返回 0.
+int mm_trim(size_t pad);
+
+// mm_init_ex 的选项, 全部为 0 时与 mm_init 相同.
+struct mm_init_options
+{
+    // 启动时就把堆扩展到这么大 (字节).
+    size_t heap_size;
+    // MM_INIT_* 的组合.
+    int flags;
+    // 非 0 时启动一个后台线程, 在堆尾之后保持至少这么多已提交并且
+    // 产生过缺页的内存, 前台扩展堆时就不需要系统调用和缺页了.
+    // 只有 vmem 后端支持. 分配器本身仍然不是线程安全的.
+    size_t reserve_size;
+    // 分配时最多比较多少个放得下的空闲块, 选剩余部分危害最小的.
+    // 1 是首次适配, 0 表示使用编译时的默认值.
+    unsigned int fit_scan_limit;
+};
+
+// 启动时对整个堆预先产生缺页.
+#define MM_INIT_PREFAULT 1
+// 启动时用 mlock 锁住整个堆.
+#define MM_INIT_MLOCK 2
+
+// 带选项的 mm_init. 出错时返回 -1, 成功时返回 0.
+int mm_init_ex(const struct mm_init_options *options);
+
+// 空闲链表的插入策略.
+// 插在链表尾, 先释放的块先被找到.
+#define MM_INSERT_FIFO 0
+// 按地址排序, 首次适配时总是先用低地址的块.
+#define MM_INSERT_ADDRESS 1
+// 在链表头部的若干个节点中按大小排序, 首次适配就近似于最佳适配.
+#define MM_INSERT_SIZE 2
+
+// 设置大小为 size 的空闲块所在的大小类的插入策略.
+// 成功时返回 0; 这个大小类由树管理, 或者 policy 无效时返回 -1.
+int mm_set_insert_policy(size_t size, int policy);
+
+// 对象的寿命, 用于 mm_malloc_hint.
+// 请求结束前就会释放.
+#define MM_SHORT_LIVED 1
+// 比请求活得长, 但迟早会释放.
+#define MM_LONG_LIVED 2
+// 直到进程结束都不释放.
+#define MM_PERMANENT 4
+
+// 按寿命分配 size 字节. 编译时打开 LIFETIME_REGIONS 的话,
+// 不同寿命的对象放在不同的区域中, 互不打碎.
+// 返回的块和 mm_malloc 的一样, 用 mm_free/mm_realloc 释放或调整.
+void *mm_malloc_hint(size_t size, int hint);
+
+// 在 hint 附近分配 size 字节, 优先使用与 hint 同一页的空闲块.
+// hint 必须是还没有释放的块, 或者 NULL. 找不到时与 mm_malloc 相同.
+void *mm_malloc_near(void *hint, size_t size);
+
+// 把块 ptr 原地扩大到至少能放下 new_size 字节, 绝不搬家.
+// 成功时返回 0; 做不到时返回 -1, 块不变, 调用者可以自己决定搬到哪里.
+int mm_try_expand(void *ptr, size_t new_size);
+
+// 提示块 ptr 会增长到 capacity 字节: 现在就占住后面的空间,
+// 并且 mm_realloc 缩小它时不再归还. 成功时返回 0; 后面的空间不够时返回 -1.
+int mm_reserve(void *ptr, size_t capacity);
+
+// 块 ptr 实际能用的字节数, 不小于申请时的大小. ptr 为 NULL 时返回 0.
+size_t mm_usable_size(void *ptr);
+
+// 至少分配 size 字节, 并把实际能用的字节数写到 *actual (可以是 NULL).
+void *mm_malloc_at_least(size_t size, size_t *actual);
+
+// 独立的堆. 每个堆有自己的地址空间, 链表和堆尾, 可以整个丢弃.
+// 其中的块只能用 mm_heap_free 释放, 不能交给 mm_free/mm_realloc.
+// mm_try_expand, mm_reserve 和 mm_usable_size 可以用于其中的块;
+// 以其中的块为 hint 时, mm_malloc_near 也在这个堆中分配.
+typedef struct mm_heap mm_heap_t;
+
+// 创建一个独立的堆. 需要先调用 mm_init, 只有 vmem 后端支持; 失败时返回 NULL.
+mm_heap_t *mm_heap_create(void);
+
+// 在堆 h 中分配/释放. h 为 NULL 时使用默认的堆.
+void *mm_heap_malloc(mm_heap_t *h, size_t size);
+void mm_heap_free(mm_heap_t *h, void *ptr);
+
+// 丢弃堆 h 和其中所有的块.
+void mm_heap_destroy(mm_heap_t *h);
+
+#endif